@@ -0,0 +1,176 @@
+/** @file
+ * @brief Merges the sketch files written by ModuleTimer and MemoryCounter (the "sketchFilename" parameter) from any number of jobs.
+ *
+ * Prints a table of the count, mean and percentiles for each module and metric, and can write the merged sketches
+ * to a new file in the same format so that the result can be merged again later.
+ *
+ * Usage: mergeBenchmarkSketches [-j threads] [-o mergedOutputFile] inputFile [inputFile ...]
+ *
+ * @author Mark Grimes (mark.grimes@bristol.ac.uk)
+ * @date 19/Oct/2026
+ */
+#include "MarksTools/Benchmarking/interface/QuantileSketch.h"
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+
+using markstools::services::QuantileSketch;
+
+//
+// Use the unnamed namespace for things only used in this file
+//
+namespace
+{
+	/// Module label, module type and metric
+	typedef std::tuple<std::string,std::string,std::string> SketchKey;
+	typedef std::map<SketchKey,QuantileSketch> SketchMap;
+
+	void mergeInto( SketchMap& destination, const SketchKey& key, const QuantileSketch& sketch )
+	{
+		auto iSketch=destination.find( key );
+		if( iSketch==destination.end() ) destination.insert( std::make_pair( key, sketch ) );
+		else iSketch->second.merge( sketch );
+	}
+
+	void mergeFile( const std::string& filename, SketchMap& destination )
+	{
+		std::ifstream inputFile( filename );
+		if( !inputFile.is_open() ) throw std::runtime_error( "Unable to open "+filename );
+
+		std::string line;
+		while( std::getline( inputFile, line ) )
+		{
+			if( line.empty() || line[0]=='#' ) continue;
+			std::istringstream lineStream( line );
+			std::string moduleLabel, moduleType, metric;
+			lineStream >> moduleLabel >> moduleType >> metric;
+			mergeInto( destination, SketchKey(moduleLabel,moduleType,metric), QuantileSketch::read(lineStream) );
+		}
+	}
+
+	/** @brief Merges every threadIndex'th file, starting at the threadIndex'th, into the given map. Errors are recorded rather than thrown. */
+	void mergeFiles( const std::vector<std::string>& filenames, size_t threadIndex, size_t numberOfThreads, SketchMap& destination, std::string& errors )
+	{
+		for( size_t fileIndex=threadIndex; fileIndex<filenames.size(); fileIndex+=numberOfThreads )
+		{
+			try
+			{
+				mergeFile( filenames[fileIndex], destination );
+			}
+			catch( std::exception& error )
+			{
+				errors+=filenames[fileIndex]+": "+error.what()+"\n";
+			}
+		}
+	}
+
+	void printUsage( std::ostream& output, const char* executableName )
+	{
+		output << "Usage: " << executableName << " [-j threads] [-o mergedOutputFile] inputFile [inputFile ...]" << "\n"
+				<< "Merges the files written with ModuleTimer's or MemoryCounter's sketchFilename parameter and prints the" << "\n"
+				<< "per module percentiles. Times are in seconds and memory in bytes." << std::endl;
+	}
+
+} // end of the unnamed namespace
+
+int main( int argc, char* argv[] )
+{
+	size_t numberOfThreads=std::max( 1u, std::thread::hardware_concurrency() );
+	std::string outputFilename;
+	std::vector<std::string> inputFilenames;
+
+	for( int argumentIndex=1; argumentIndex<argc; ++argumentIndex )
+	{
+		std::string argument( argv[argumentIndex] );
+		if( argument=="-h" || argument=="--help" )
+		{
+			printUsage( std::cout, argv[0] );
+			return 0;
+		}
+		else if( argument=="-j" )
+		{
+			// Anything that isn't a whole number of threads is an error rather than quietly being taken as one
+			char* pEnd=nullptr;
+			long requestedThreads=( argumentIndex+1<argc ? std::strtol( argv[argumentIndex+1], &pEnd, 10 ) : 0 );
+			if( pEnd==nullptr || pEnd==argv[argumentIndex+1] || *pEnd!='\0' || requestedThreads<1 || requestedThreads>1024 )
+			{
+				std::cerr << "The -j option needs a number of threads between 1 and 1024" << std::endl;
+				printUsage( std::cerr, argv[0] );
+				return -1;
+			}
+			numberOfThreads=requestedThreads;
+			++argumentIndex;
+		}
+		else if( argument=="-o" && argumentIndex+1<argc ) outputFilename=argv[++argumentIndex];
+		else inputFilenames.push_back( argument );
+	}
+	if( inputFilenames.empty() )
+	{
+		printUsage( std::cerr, argv[0] );
+		return -1;
+	}
+	numberOfThreads=std::min( numberOfThreads, inputFilenames.size() );
+
+	//
+	// Each thread merges its share of the files into its own map, then they're all merged
+	// together at the end. Merging is exact so the order doesn't matter.
+	//
+	std::vector<SketchMap> threadResults( numberOfThreads );
+	std::vector<std::string> threadErrors( numberOfThreads );
+	std::vector<std::thread> threads;
+	for( size_t threadIndex=0; threadIndex<numberOfThreads; ++threadIndex )
+	{
+		threads.emplace_back( &::mergeFiles, std::cref(inputFilenames), threadIndex, numberOfThreads, std::ref(threadResults[threadIndex]), std::ref(threadErrors[threadIndex]) );
+	}
+	for( auto& thread : threads ) thread.join();
+
+	SketchMap merged;
+	bool hadErrors=false;
+	for( size_t threadIndex=0; threadIndex<numberOfThreads; ++threadIndex )
+	{
+		if( !threadErrors[threadIndex].empty() )
+		{
+			std::cerr << threadErrors[threadIndex];
+			hadErrors=true;
+		}
+		for( const auto& keyAndSketch : threadResults[threadIndex] ) ::mergeInto( merged, keyAndSketch.first, keyAndSketch.second );
+	}
+
+	std::cout << "moduleLabel,moduleType,metric,count,mean,p50,p90,p99,p99.9,max" << "\n";
+	for( const auto& keyAndSketch : merged )
+	{
+		const QuantileSketch& sketch=keyAndSketch.second;
+		std::cout << std::get<0>(keyAndSketch.first) << "," << std::get<1>(keyAndSketch.first) << "," << std::get<2>(keyAndSketch.first)
+				<< "," << sketch.count() << "," << ( sketch.count()>0 ? sketch.sum()/sketch.count() : 0 ) << "," << sketch.quantile(0.5)
+				<< "," << sketch.quantile(0.9) << "," << sketch.quantile(0.99) << "," << sketch.quantile(0.999) << "," << sketch.maximum() << "\n";
+	}
+
+	if( !outputFilename.empty() )
+	{
+		std::ofstream outputFile( outputFilename );
+		if( !outputFile.is_open() )
+		{
+			std::cerr << "Unable to open " << outputFilename << " for writing" << std::endl;
+			return -1;
+		}
+		outputFile << "# moduleLabel moduleType metric sketch" << "\n";
+		for( const auto& keyAndSketch : merged )
+		{
+			outputFile << std::get<0>(keyAndSketch.first) << " " << std::get<1>(keyAndSketch.first) << " " << std::get<2>(keyAndSketch.first) << " ";
+			keyAndSketch.second.write( outputFile );
+			outputFile << "\n";
+		}
+	}
+
+	return hadErrors ? -1 : 0;
+}
@@ -0,0 +1,64 @@
+#ifndef markstools_services_AllocationObserver_h
+#define markstools_services_AllocationObserver_h
+
+#include <cstddef>
+#include <dlfcn.h>
+
+//
+// Forward declarations
+//
+namespace memcounter
+{
+	class IMemoryCounter;
+}
+
+namespace markstools
+{
+	namespace services
+	{
+		/** @brief Interface to something that wants to be told about the individual allocations a memory counter sees.
+		 *
+		 * NOTE: this is NOT part of any MemCounter release. Stock intrusiveMemoryAnalyser has no way of passing on
+		 * individual allocations, so anything using this (i.e. heap sampling in MemoryCounter) needs a MemCounter
+		 * patched to export
+		 *
+		 *     extern "C" bool setMemoryCounterAllocationObserver_v1( memcounter::IMemoryCounter*, markstools::services::IAllocationObserver* );
+		 *
+		 * which has to call allocated for every allocation made while the counter is enabled, and deallocated for
+		 * every block owned by the counter when it's freed, whether the counter is enabled or not. Both are called
+		 * from inside the allocation hook, so implementations must be quick and must cope with being re-entered if
+		 * they allocate themselves. If the layout of this class ever changes the version in the symbol name has to
+		 * change with it, so that an old library is never handed an observer it doesn't understand.
+		 *
+		 * @author Mark Grimes (mark.grimes@bristol.ac.uk)
+		 * @date 19/Oct/2026
+		 */
+		class IAllocationObserver
+		{
+		public:
+			virtual void allocated( void* pointer, size_t size ) = 0;
+			virtual void deallocated( void* pointer ) = 0;
+		protected:
+			virtual ~IAllocationObserver() {}
+		}; // end of the IAllocationObserver class
+
+		/** @brief Tells the preloaded library to pass every allocation and deallocation for pCounter on to pObserver.
+		 *
+		 * Returns false if the preloaded library hasn't been patched to support observers (see IAllocationObserver),
+		 * which is the case for every MemCounter release. Pass nullptr to remove the observer.
+		 */
+		inline bool setAllocationObserver( memcounter::IMemoryCounter* pCounter, IAllocationObserver* pObserver )
+		{
+			bool (*setObserver)( memcounter::IMemoryCounter*, IAllocationObserver* );
+			if( void *sym = dlsym(0, "setMemoryCounterAllocationObserver_v1") )
+			{
+				setObserver = __extension__(bool(*)(memcounter::IMemoryCounter*,IAllocationObserver*)) sym;
+				return setObserver( pCounter, pObserver );
+			}
+			return false;
+		}
+
+	} // end of namespace services
+} // end of namespace markstools
+
+#endif // end of #ifndef markstools_services_AllocationObserver_h
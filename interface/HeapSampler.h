@@ -0,0 +1,57 @@
+#ifndef markstools_services_HeapSampler_h
+#define markstools_services_HeapSampler_h
+
+#include <string>
+#include <iosfwd>
+
+namespace markstools
+{
+	namespace services
+	{
+		class IAllocationObserver;
+
+		/** @brief Records the call stack for a sample of allocations, roughly one per meanSampleInterval bytes.
+		 *
+		 * Works the same way as the tcmalloc heap profiler. Each thread counts down a random number of bytes drawn
+		 * from an exponential distribution, and the allocation that takes the count below zero has its stack
+		 * recorded. That sample is then weighted to stand for all the bytes in between. Stacks are interned in one
+		 * table, so repeated call sites only cost a lookup. Only the sampled pointers are remembered, so the cost of
+		 * the allocations that aren't sampled is a subtraction and of the frees a lookup in a 1 MiB counting filter,
+		 * without taking the lock. Stacks are taken by following frame pointers (see StackWalk.h), so they stop
+		 * early in code built without them.
+		 *
+		 * Allocations are fed in by the intrusiveMemoryAnalyser through the observer returned by observerForModule,
+		 * which is set on that module's IMemoryCounter. MemoryCounter does this when "heapSampleInterval" is set. That
+		 * only works with a MemCounter patched to support observers, see AllocationObserver.h.
+		 *
+		 * @author Mark Grimes (mark.grimes@bristol.ac.uk)
+		 * @date 19/Oct/2026
+		 */
+		class HeapSampler
+		{
+		public:
+			HeapSampler( size_t meanSampleInterval );
+			virtual ~HeapSampler();
+
+			/// @brief Returns the observer that attributes allocations to the given module. Ownership stays with the HeapSampler.
+			IAllocationObserver* observerForModule( const std::string& moduleLabel, const std::string& moduleType );
+
+			/** @brief Writes "moduleLabel;outermostFrame;...;innermostFrame bytes" lines, as used by flamegraph.pl
+			 *
+			 * If liveBytes is true the estimated bytes still held are written, otherwise the estimated total allocated. */
+			void writeFoldedStacks( std::ostream& output, bool liveBytes ) const;
+
+			/// @brief Prints " *HEAPSAMPLE* " lines with the total estimated allocated and live bytes per module
+			void printSummary( std::ostream& output ) const;
+
+			HeapSampler( const HeapSampler& otherHeapSampler ) = delete;
+			HeapSampler& operator=( const HeapSampler& otherHeapSampler ) = delete;
+		private:
+			/// @brief Hide all the private members in a pimple. Google "pimple idiom" for details.
+			class HeapSamplerPimple* pImple_;
+		}; // end of class HeapSampler
+
+	} // end of namespace services
+} // end of namespace markstools
+
+#endif // end of #ifndef markstools_services_HeapSampler_h
@@ -0,0 +1,73 @@
+#ifndef markstools_services_QuantileSketch_h
+#define markstools_services_QuantileSketch_h
+
+#include <vector>
+#include <string>
+#include <iosfwd>
+#include <cstdint>
+
+namespace markstools
+{
+	namespace services
+	{
+		/** @brief Fixed size summary of a distribution that can be merged with others without losing accuracy.
+		 *
+		 * This is the DDSketch algorithm (Masson, Rim and Lee, 2019). Values are put into logarithmically sized bins
+		 * so that any quantile is returned to within the given relative accuracy, however long the tail. Merging two
+		 * sketches is just adding the bin counts, so the sketches from thousands of jobs can be combined in any order
+		 * and give exactly the same result as one sketch of all the values.
+		 *
+		 * The number of bins only depends on the range of the values (about 1000 bins covers eight orders of magnitude
+		 * at 1% accuracy), not on how many values there are. If it goes over maximumBins the lowest bins are collapsed
+		 * together, which only affects the accuracy of the lowest quantiles.
+		 *
+		 * Values less than or equal to minimumValue(), including anything negative, are all counted as zero.
+		 *
+		 * @author Mark Grimes (mark.grimes@bristol.ac.uk)
+		 * @date 19/Oct/2026
+		 */
+		class QuantileSketch
+		{
+		public:
+			QuantileSketch( double relativeAccuracy=0.01, size_t maximumBins=2048 );
+
+			void add( double value );
+			/// @brief Adds all of the values in the other sketch. Throws std::runtime_error if the accuracies are different.
+			void merge( const QuantileSketch& otherSketch );
+
+			/// @brief Returns the value at the given quantile (between 0 and 1), to within the relative accuracy
+			double quantile( double fraction ) const;
+
+			uint64_t count() const { return count_; }
+			double sum() const { return sum_; }
+			double minimum() const { return minimum_; }
+			double maximum() const { return maximum_; }
+			double relativeAccuracy() const { return relativeAccuracy_; }
+			static double minimumValue() { return 1e-9; }
+
+			/// @brief Writes everything on one line of space separated text, with no newline
+			void write( std::ostream& output ) const;
+			/// @brief Reads what was written by write. Throws std::runtime_error if it can't be parsed.
+			static QuantileSketch read( std::istream& input );
+		private:
+			int key( double value ) const;
+			double valueForKey( int key ) const;
+			/// @brief If there are more than maximumBins_ bins, adds the lowest ones together so that there aren't
+			void collapseLowestBins();
+
+			double relativeAccuracy_;
+			double logGamma_;
+			size_t maximumBins_;
+			uint64_t count_;
+			uint64_t zeroCount_;
+			double sum_;
+			double minimum_;
+			double maximum_;
+			int firstKey_; ///< The key of the first entry in binCounts_
+			std::vector<uint64_t> binCounts_;
+		}; // end of class QuantileSketch
+
+	} // end of namespace services
+} // end of namespace markstools
+
+#endif // end of #ifndef markstools_services_QuantileSketch_h
@@ -0,0 +1,31 @@
+#ifndef markstools_services_StackWalk_h
+#define markstools_services_StackWalk_h
+
+namespace markstools
+{
+	namespace services
+	{
+		/** @brief Records a call stack by following the frame pointer chain, for use inside allocation hooks and signal handlers.
+		 *
+		 * backtrace() goes through the libgcc unwinder, which takes the loader and FDE locks and can allocate, so
+		 * it can deadlock or recurse if it interrupts the same thread in malloc, dl_iterate_phdr or exception
+		 * unwinding. This only reads memory and never locks or allocates. Every frame record is checked to be
+		 * readable before it's read (with the same rt_sigprocmask trick gperftools uses) and each frame has to be
+		 * above the last, so a broken chain ends the walk rather than crashing.
+		 *
+		 * The price is that frames compiled without frame pointers (-fomit-frame-pointer, the default with
+		 * optimisation on x86-64) are skipped or end the stack early. Build with -fno-omit-frame-pointer for full
+		 * stacks. Like backtrace(), the addresses are return addresses with the innermost first.
+		 *
+		 * @author Mark Grimes (mark.grimes@bristol.ac.uk)
+		 * @date 19/Oct/2026
+		 */
+		int walkFramePointers( void* programCounter, void* framePointer, void** frames, int maximumDepth );
+
+		/** @brief Same as walkFramePointers, but for the calling function. The first frame is the return address into the caller. */
+		int walkFramePointersFromHere( void** frames, int maximumDepth );
+
+	} // end of namespace services
+} // end of namespace markstools
+
+#endif // end of #ifndef markstools_services_StackWalk_h
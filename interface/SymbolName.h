@@ -0,0 +1,23 @@
+#ifndef markstools_services_SymbolName_h
+#define markstools_services_SymbolName_h
+
+#include <string>
+
+namespace markstools
+{
+	namespace services
+	{
+		/** @brief Turns a code address from backtrace() into "function" or "library+offset", demangling if possible.
+		 *
+		 * Used by the sampling profilers when writing their folded stacks. It calls dladdr and allocates, so
+		 * only call it at the end of the job rather than while sampling.
+		 *
+		 * @author Mark Grimes (mark.grimes@bristol.ac.uk)
+		 * @date 19/Oct/2026
+		 */
+		std::string symbolName( void* address );
+
+	} // end of namespace services
+} // end of namespace markstools
+
+#endif // end of #ifndef markstools_services_SymbolName_h
@@ -0,0 +1,44 @@
+#ifndef markstools_services_TransitionName_h
+#define markstools_services_TransitionName_h
+
+#include <cstddef>
+#include <string>
+#include <ostream>
+
+namespace markstools
+{
+	namespace services
+	{
+		/** @brief The name of a framework transition, e.g. "event" or "beginLumi", plus the event, lumi or run number if it has one.
+		 *
+		 * The services get called for every module on every transition, so the names are string literals and
+		 * the number is copied rather than formatted. Nothing gets turned into a string until it's printed, which
+		 * means a module that isn't being analysed costs nothing at all.
+		 *
+		 * @author Mark Grimes (mark.grimes@bristol.ac.uk)
+		 * @date 19/Oct/2026
+		 */
+		class TransitionName
+		{
+		public:
+			TransitionName() : pName_(""), number_(0), hasNumber_(false) {}
+			/// @brief pNumber should point to the service's counter, or be null if the transition doesn't have a number. The value is copied.
+			TransitionName( const char* pName, const size_t* pNumber ) : pName_(pName), number_( pNumber ? *pNumber : 0 ), hasNumber_( pNumber!=nullptr ) {}
+
+			std::string str() const { return hasNumber_ ? pName_+std::to_string(number_) : std::string(pName_); }
+			friend std::ostream& operator<<( std::ostream& output, const TransitionName& transition )
+			{
+				output << transition.pName_;
+				if( transition.hasNumber_ ) output << transition.number_;
+				return output;
+			}
+		private:
+			const char* pName_; ///< Always a string literal, so there's no need to worry about its lifetime
+			size_t number_;
+			bool hasNumber_;
+		}; // end of class TransitionName
+
+	} // end of namespace services
+} // end of namespace markstools
+
+#endif // end of #ifndef markstools_services_TransitionName_h
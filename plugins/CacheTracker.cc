@@ -0,0 +1,306 @@
+#include "CacheTracker.h"
+#include "NestedCallStack.h"
+#include "MarksTools/Benchmarking/interface/QuantileSketch.h"
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <map>
+#include <limits>
+#include <algorithm>
+#include <DataFormats/Provenance/interface/ModuleDescription.h>
+
+//
+// Use the unnamed namespace for things only used in this file.
+//
+namespace
+{
+	/// Pairs with fewer calls than this aren't reported, since the median wouldn't mean much
+	const uint64_t minimumPairCalls=10;
+	/// The memory traffic is estimated as one cache line for every last level cache miss
+	const uint64_t cacheLineBytes=64;
+	const unsigned int noPredecessor=std::numeric_limits<unsigned int>::max();
+	/// Relative accuracy of the CPU time sketches. Differences between medians smaller than twice this aren't reported.
+	const double sketchAccuracy=0.005;
+
+	struct CacheCounters
+	{
+		uint64_t references;
+		uint64_t misses;
+		double cpuSeconds;
+		CacheCounters() : references(0), misses(0), cpuSeconds(0) {}
+
+		CacheCounters& operator+=( const CacheCounters& other )
+		{
+			references+=other.references; misses+=other.misses; cpuSeconds+=other.cpuSeconds;
+			return *this;
+		}
+		CacheCounters& operator-=( const CacheCounters& other )
+		{
+			references-=other.references; misses-=other.misses; cpuSeconds-=other.cpuSeconds;
+			return *this;
+		}
+	};
+
+	int openCounter( uint64_t config, int groupFileDescriptor )
+	{
+		perf_event_attr attributes;
+		std::memset( &attributes, 0, sizeof(attributes) );
+		attributes.size=sizeof(attributes);
+		attributes.type=PERF_TYPE_HARDWARE;
+		attributes.config=config;
+		attributes.exclude_kernel=1;
+		attributes.exclude_hv=1;
+		attributes.read_format=PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		// A pid of zero and cpu of -1 means the calling thread, on whichever CPU it runs
+		return syscall( SYS_perf_event_open, &attributes, 0, -1, groupFileDescriptor, 0 );
+	}
+
+	/** @brief Opens the counters for the calling thread as one group, so they're always read together. Returns the group leader or -1.
+	 *
+	 * On success the group member is put in memberFileDescriptor, since it has to be kept open as well. */
+	int openThreadCounters( int& memberFileDescriptor )
+	{
+		int leader=::openCounter( PERF_COUNT_HW_CACHE_REFERENCES, -1 );
+		if( leader<0 ) return -1;
+		memberFileDescriptor=::openCounter( PERF_COUNT_HW_CACHE_MISSES, leader );
+		if( memberFileDescriptor<0 )
+		{
+			close( leader );
+			return -1;
+		}
+		return leader;
+	}
+
+	/// Every CacheTracker gets a new number, so that threads don't use counters that an earlier one has closed
+	std::atomic<unsigned int> nextTrackerNumber( 0 );
+
+	/// The group leader, kept open until the CacheTracker is destroyed. -1 if it couldn't be opened.
+	thread_local int threadCounters=-1;
+	/// Which CacheTracker threadCounters was opened for, zero if it hasn't been yet
+	thread_local unsigned int threadCountersTracker=0;
+
+	/** @brief Reads the cache counters from the group leader, or leaves them zero if they're not available. Doesn't set the CPU time. */
+	::CacheCounters readCounters( int leader )
+	{
+		::CacheCounters counters;
+		if( leader<0 ) return counters;
+
+		// With PERF_FORMAT_GROUP it's the number of counters, the time enabled, the time running, then the values
+		uint64_t buffer[5];
+		if( read( leader, buffer, sizeof(buffer) )!=sizeof(buffer) || buffer[0]!=2 ) return counters;
+		// If something else is using the PMU the counters are multiplexed, so scale them up to the whole time
+		double scale=( buffer[2]>0 && buffer[2]<buffer[1] ) ? double(buffer[1])/buffer[2] : 1;
+		counters.references=buffer[3]*scale;
+		counters.misses=buffer[4]*scale;
+		return counters;
+	}
+
+	double threadCpuSeconds()
+	{
+		struct timespec time;
+		clock_gettime( CLOCK_THREAD_CPUTIME_ID, &time );
+		return time.tv_sec+time.tv_nsec*1e-9;
+	}
+
+	/// The counters at the start of each call running on this thread, with the ID of the call's predecessor
+	thread_local markstools::services::NestedCallStack<::CacheCounters,unsigned int> callStack;
+	/// The last module to finish on this thread, and the CPU the thread was on when it did
+	thread_local unsigned int lastModuleId=::noPredecessor;
+	thread_local int lastCpu=-1;
+
+	struct ModuleCache
+	{
+		std::string moduleLabel;
+		std::string moduleName;
+		uint64_t calls;
+		::CacheCounters counters;
+		markstools::services::QuantileSketch cpuTime;
+		ModuleCache() : calls(0), cpuTime(::sketchAccuracy) {}
+	};
+
+	struct PairCache
+	{
+		::CacheCounters counters;
+		markstools::services::QuantileSketch cpuTime;
+		PairCache() : cpuTime(::sketchAccuracy) {}
+	};
+
+	double mebibytes( uint64_t misses )
+	{
+		return double(misses*::cacheLineBytes)/(1024*1024);
+	}
+
+	void printLine( std::ostream& output, const std::string& label, const std::string& moduleName, uint64_t calls, const ::CacheCounters& counters )
+	{
+		output << " *CACHEREPORT* " << label << "," << moduleName << "," << calls << "," << counters.cpuSeconds
+				<< "," << counters.references << "," << counters.misses << "," << ( counters.references>0 ? 100.0*counters.misses/counters.references : 0 )
+				<< "," << ::mebibytes( counters.misses ) << "," << ( counters.cpuSeconds>0 ? ::mebibytes( counters.misses )/counters.cpuSeconds : 0 ) << "\n";
+	}
+
+} // end of the unnamed namespace
+
+//
+// Define the pimple class
+//
+namespace markstools
+{
+	namespace services
+	{
+		class CacheTrackerPimple
+		{
+		public:
+			/// @brief Opens the calling thread's counters the first time it's called for this tracker
+			::CacheCounters readThreadCounters();
+
+			size_t pairsToReport_;
+			unsigned int trackerNumber_;
+			std::mutex fileDescriptorMutex_; ///< Protects fileDescriptors_
+			std::vector<int> fileDescriptors_; ///< Every thread's counters, so that they can be closed at the end
+			std::mutex mutex_; ///< Protects modules_ and pairs_
+			std::vector<::ModuleCache> modules_; ///< Indexed by ModuleDescription::id(), entries with no calls are modules that never ran
+			std::map<std::pair<unsigned int,unsigned int>,::PairCache> pairs_; ///< Keyed on the predecessor's ID then the module's
+		}; // end of the CacheTrackerPimple class
+
+	} // end of the markstools::services namespace
+} // end of the markstools namespace
+
+markstools::services::CacheTracker::CacheTracker( size_t pairsToReport )
+	: pImple_( new CacheTrackerPimple )
+{
+	pImple_->pairsToReport_=pairsToReport;
+	pImple_->trackerNumber_=++::nextTrackerNumber;
+
+	int fileDescriptor=::openCounter( PERF_COUNT_HW_CACHE_MISSES, -1 );
+	if( fileDescriptor<0 ) std::cerr << " *** ModuleTimer: unable to open the cache counters with perf_event_open, so only the predecessor timings will be reported." << std::endl;
+	else close( fileDescriptor );
+}
+
+markstools::services::CacheTracker::~CacheTracker()
+{
+	for( const auto fileDescriptor : pImple_->fileDescriptors_ ) close( fileDescriptor );
+	delete pImple_;
+}
+
+::CacheCounters markstools::services::CacheTrackerPimple::readThreadCounters()
+{
+	if( ::threadCountersTracker!=trackerNumber_ )
+	{
+		int memberFileDescriptor=-1;
+		::threadCounters=::openThreadCounters( memberFileDescriptor );
+		::threadCountersTracker=trackerNumber_;
+		if( ::threadCounters>=0 )
+		{
+			std::lock_guard<std::mutex> lock( fileDescriptorMutex_ );
+			fileDescriptors_.push_back( ::threadCounters );
+			fileDescriptors_.push_back( memberFileDescriptor );
+		}
+	}
+	return ::readCounters( ::threadCounters );
+}
+
+void markstools::services::CacheTracker::preModule()
+{
+	// Only count the predecessor if this thread is still on the same core, otherwise its caches are somewhere else
+	unsigned int predecessorId=( sched_getcpu()==::lastCpu ? ::lastModuleId : ::noPredecessor );
+
+	// Read the counters last so that as little as possible of this gets counted
+	::CacheCounters& startCounters=::callStack.push( predecessorId );
+	startCounters=pImple_->readThreadCounters();
+	startCounters.cpuSeconds=::threadCpuSeconds();
+}
+
+void markstools::services::CacheTracker::postModule( const edm::ModuleDescription& description )
+{
+	double cpuSeconds=::threadCpuSeconds();
+	::CacheCounters counters=pImple_->readThreadCounters();
+	counters.cpuSeconds=cpuSeconds;
+	unsigned int predecessorId;
+	if( !::callStack.pop( counters, &predecessorId ) ) return; // Started before tracking was set up
+
+	::lastModuleId=description.id();
+	::lastCpu=sched_getcpu();
+
+	std::lock_guard<std::mutex> lock( pImple_->mutex_ );
+	if( pImple_->modules_.size()<=description.id() ) pImple_->modules_.resize( description.id()+1 );
+	::ModuleCache& moduleCache=pImple_->modules_[description.id()];
+	if( moduleCache.calls==0 )
+	{
+		moduleCache.moduleLabel=description.moduleLabel();
+		moduleCache.moduleName=description.moduleName();
+	}
+	++moduleCache.calls;
+	moduleCache.counters+=counters;
+	moduleCache.cpuTime.add( counters.cpuSeconds );
+
+	if( predecessorId==::noPredecessor ) return;
+	::PairCache& pairCache=pImple_->pairs_[std::make_pair(predecessorId,description.id())];
+	pairCache.counters+=counters;
+	pairCache.cpuTime.add( counters.cpuSeconds );
+}
+
+void markstools::services::CacheTracker::print( std::ostream& output )
+{
+	std::lock_guard<std::mutex> lock( pImple_->mutex_ );
+
+	// Most misses first
+	std::vector<const ::ModuleCache*> sortedModules;
+	::CacheCounters total;
+	uint64_t totalCalls=0;
+	for( const auto& moduleCache : pImple_->modules_ )
+	{
+		if( moduleCache.calls==0 ) continue;
+		sortedModules.push_back( &moduleCache );
+		total+=moduleCache.counters;
+		totalCalls+=moduleCache.calls;
+	}
+	std::sort( sortedModules.begin(), sortedModules.end(), []( const ::ModuleCache* pFirst, const ::ModuleCache* pSecond ){ return pFirst->counters.misses > pSecond->counters.misses; } );
+
+	for( const auto pModule : sortedModules ) ::printLine( output, pModule->moduleLabel, pModule->moduleName, pModule->calls, pModule->counters );
+	::printLine( output, "TOTAL", std::to_string( sortedModules.size() ), totalCalls, total ); // The number of modules in place of the type
+
+	// Rank the pairs by how much CPU time in total the predecessor cost the module, compared to the module's median
+	struct Penalty
+	{
+		const ::ModuleCache* pPredecessor;
+		const ::ModuleCache* pModule;
+		const ::PairCache* pPair;
+		double moduleMedian;
+		double pairMedian;
+		double totalSeconds;
+	};
+	std::vector<Penalty> penalties;
+	for( const auto& idsAndPair : pImple_->pairs_ )
+	{
+		const ::PairCache& pairCache=idsAndPair.second;
+		if( pairCache.cpuTime.count()<::minimumPairCalls ) continue;
+		const ::ModuleCache& moduleCache=pImple_->modules_.at( idsAndPair.first.second );
+		double moduleMedian=moduleCache.cpuTime.quantile(0.5);
+		double pairMedian=pairCache.cpuTime.quantile(0.5);
+		double totalSeconds=(pairMedian-moduleMedian)*pairCache.cpuTime.count();
+		// Each median is only known to within the sketch accuracy, so anything smaller could just be that
+		if( moduleMedian>0 && pairMedian>moduleMedian*(1+2*::sketchAccuracy) ) penalties.push_back( Penalty{ &pImple_->modules_.at( idsAndPair.first.first ), &moduleCache, &pairCache, moduleMedian, pairMedian, totalSeconds } );
+	}
+	size_t numberToPrint=std::min( penalties.size(), pImple_->pairsToReport_ );
+	std::partial_sort( penalties.begin(), penalties.begin()+numberToPrint, penalties.end(), []( const Penalty& first, const Penalty& second ){ return first.totalSeconds > second.totalSeconds; } );
+
+	for( size_t index=0; index<numberToPrint; ++index )
+	{
+		const Penalty& penalty=penalties[index];
+		uint64_t pairCalls=penalty.pPair->cpuTime.count();
+		output << " *COLDSTART* " << penalty.pPredecessor->moduleLabel << "," << penalty.pModule->moduleLabel << "," << pairCalls
+				<< "," << penalty.moduleMedian*1e3 << "," << penalty.pairMedian*1e3 << "," << 100*(penalty.pairMedian/penalty.moduleMedian-1)
+				<< "," << double(penalty.pPair->counters.misses)/pairCalls << "," << double(penalty.pModule->counters.misses)/penalty.pModule->calls
+				<< "," << penalty.totalSeconds << "\n";
+	}
+	output.flush();
+}
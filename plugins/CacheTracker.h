@@ -0,0 +1,62 @@
+#ifndef markstools_services_CacheTracker_h
+#define markstools_services_CacheTracker_h
+
+#include <iosfwd>
+#include <cstddef>
+
+namespace edm
+{
+	class ModuleDescription;
+}
+
+namespace markstools
+{
+	namespace services
+	{
+		/** @brief Counts last level cache references and misses for each module call, and how much slower modules run after each other module.
+		 *
+		 * Not a service in itself, ModuleTimer owns one of these if the "cacheReport" parameter is set. Each
+		 * thread opens a perf_event group counting its own cache references and misses (user space only, so it
+		 * works with the default perf_event_paranoid setting), which is read at the start and end of every event
+		 * call. The memory traffic is estimated as one cache line per miss. Real memory bandwidth counters are in
+		 * the uncore and count everything on the socket, so can't be split between modules.
+		 *
+		 * To see whether a module is slowed down by whatever ran before it, the CPU time of every call is also
+		 * kept per predecessor, i.e. the module that last finished on the same thread. If the thread has moved
+		 * to a different CPU since then the predecessor's working set isn't in this core's caches, so those calls
+		 * aren't attributed to any predecessor. At the end of the job the pairs where the module's median CPU
+		 * time is furthest above its median over all calls, weighted by the number of calls, are printed. The
+		 * medians are accurate to 0.5%, so differences of less than 1% are left out.
+		 *
+		 * If a module calls other modules (unscheduled) their counts and time are subtracted from its own, so
+		 * the numbers for each module are exclusive. If the counters aren't available (e.g. in a virtual machine)
+		 * they read zero but the predecessor timings still work. Every thread's counters stay open until this is
+		 * destroyed.
+		 *
+		 * @author Mark Grimes (mark.grimes@bristol.ac.uk)
+		 * @date 19/Oct/2026
+		 */
+		class CacheTracker
+		{
+		public:
+			/// @brief pairsToReport is how many of the worst predecessor and module pairs to print at the end
+			CacheTracker( size_t pairsToReport );
+			virtual ~CacheTracker();
+
+			void preModule();
+			void postModule( const edm::ModuleDescription& description );
+
+			/// @brief Prints a " *CACHEREPORT* " line for each module, most misses first, then " *COLDSTART* " lines for the worst pairs
+			void print( std::ostream& output );
+
+			CacheTracker( const CacheTracker& otherCacheTracker ) = delete;
+			CacheTracker& operator=( const CacheTracker& otherCacheTracker ) = delete;
+		private:
+			/// @brief Hide all the private members in a pimple. Google "pimple idiom" for details.
+			class CacheTrackerPimple* pImple_;
+		}; // end of class CacheTracker
+
+	} // end of namespace services
+} // end of namespace markstools
+
+#endif // end of #ifndef markstools_services_CacheTracker_h
@@ -1,13 +1,23 @@
 #include "CheckRSSService.h"
+#include "NestedCallStack.h"
 
 #include <iostream>
 #include <fstream>
 #include <stdexcept>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <mutex>
+#include <chrono>
+#include <deque>
 #include <unistd.h>
 #include <boost/algorithm/string.hpp> // For splitting up strings read from /proc/<pid>/statm
 #include <DataFormats/Provenance/interface/ModuleDescription.h>
+#include "FWCore/MessageLogger/interface/MessageLogger.h"
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
 #include "FWCore/ServiceRegistry/interface/ActivityRegistry.h"
+#include "MarksTools/Benchmarking/interface/TransitionName.h"
 
 // The signals in ActivityRegistry changed drastically to cover threaded
 // use, so I need to conditionally compile certain things depending on the
@@ -17,6 +27,10 @@
 #ifdef AR_WATCH_USING_METHOD_3
 #	define USE_NEW_ACTIVITYREGISTRY_SIGNALS
 #	include "FWCore/ServiceRegistry/interface/ModuleCallingContext.h"
+#	include "FWCore/ServiceRegistry/interface/GlobalContext.h"
+#else
+#	include "FWCore/Framework/interface/LuminosityBlock.h"
+#	include "FWCore/Framework/interface/Run.h"
 #endif
 
 //
@@ -36,17 +50,96 @@ namespace
 	// modified in the constructor.
 	int global_pageSizeInKb=0; // Set to zero so it's obvious if an uninitiated value is ever used.
 
-	::MemoryUse getMemoryUse( const std::string& pid )
+	/** @brief Totals for the module calls between two boundaries, i.e. for a lumi or a run
+	 *
+	 * Lumis (and runs) can overlap when CMSSW processes more than one at once. Rather than try and split
+	 * module calls between them, a window starts when the first one begins and each end closes the window
+	 * and starts a new one straight away if there are others still open. So the windows never overlap and
+	 * nothing is missed or counted twice.
+	 */
+	struct Window
 	{
-		std::ifstream inputFile( "/proc/"+pid+"/statm" );
-		if( !inputFile.is_open() ) throw std::runtime_error( "Unable to open /proc/"+pid+"/statm" );
+		unsigned int open=0; ///< How many lumis (or runs) have begun and not yet ended
+		int startRSS=0; ///< KiB
+		int peakRSS=0; ///< KiB, of the samples taken at module boundaries so anything between those is missed
+		double moduleSeconds=0; ///< Real time summed over all the analysed module calls, on all threads
+		std::vector<int> moduleGrowthById; ///< Change in RSS in KiB during each module's calls, indexed by ModuleDescription::id()
+
+		void reset( int rss )
+		{
+			startRSS=peakRSS=rss;
+			moduleSeconds=0;
+			std::fill( moduleGrowthById.begin(), moduleGrowthById.end(), 0 );
+		}
+		void begin( int rss ) { if( open++==0 ) reset( rss ); }
+		/// @brief Starts the next window if there are others still open. Call after the summary has been printed.
+		void end( int rss ) { if( open>0 && --open>0 ) reset( rss ); }
+		void addSample( int rss ) { peakRSS=std::max( peakRSS, rss ); }
+		void addModuleCall( unsigned int moduleId, int growth, double seconds )
+		{
+			if( moduleGrowthById.size()<=moduleId ) moduleGrowthById.resize( moduleId+1, 0 );
+			moduleGrowthById[moduleId]+=growth;
+			moduleSeconds+=seconds;
+		}
+	};
+
+	/** @brief The RSS and time at the start or end of a module call, or the difference between the two */
+	struct RSSAndTime
+	{
+		int rss; ///< KiB
+		double seconds; ///< On the steady clock
+		RSSAndTime() : rss(0), seconds(0) {}
+		RSSAndTime( int newRSS ) : rss(newRSS), seconds( std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count() ) {}
+
+		RSSAndTime& operator+=( const RSSAndTime& other ) { rss+=other.rss; seconds+=other.seconds; return *this; }
+		RSSAndTime& operator-=( const RSSAndTime& other ) { rss-=other.rss; seconds-=other.seconds; return *this; }
+	};
+	/// The module calls running on this thread, so that modules called from inside another (unscheduled) can be taken off its numbers
+	thread_local markstools::services::NestedCallStack<::RSSAndTime> threadLocal_moduleCallStack;
+
+	/** @brief Which modules to dump the RSS for, worked out once per module when it's constructed, and the lumi and run totals */
+	struct DumpSettings
+	{
+		std::string statmFilename; ///< "/proc/<pid>/statm", so that it doesn't have to be built every time
+		std::vector<std::string> modulesToAnalyse; ///< Empty means analyse every module
+		std::vector<char> analyseModuleById; ///< Indexed by ModuleDescription::id(). A vector<bool> would need bit twiddling on every lookup.
+		std::vector<std::string> moduleLabelById; ///< So that the summaries can name the modules that grew the most
+
+		std::mutex totalsMutex; ///< Module calls on different streams update the totals at the same time
+		::Window lumi;
+		::Window run;
+		size_t topGrowthModules=3; ///< How many modules to list in each summary
+		unsigned int growthWarningLumis=5;
+		double growthWarningKiBPerLumi=0; ///< Zero means never warn
+		std::deque<int> lumiEndRSS; ///< The RSS at the end of each of the last growthWarningLumis+1 lumis
+
+		void selectModule( const edm::ModuleDescription& description )
+		{
+			if( analyseModuleById.size()<=description.id() ) analyseModuleById.resize( description.id()+1, false );
+			analyseModuleById[description.id()]=( modulesToAnalyse.empty() || std::find( modulesToAnalyse.begin(), modulesToAnalyse.end(), description.moduleLabel() )!=modulesToAnalyse.end() );
+			if( moduleLabelById.size()<=description.id() ) moduleLabelById.resize( description.id()+1 );
+			moduleLabelById[description.id()]=description.moduleLabel();
+		}
+		bool isAnalysed( const edm::ModuleDescription& description ) const
+		{
+			return description.id()<analyseModuleById.size() && analyseModuleById[description.id()];
+		}
+	};
+
+	/** @brief Whether a callback is for the start or the end of a module call */
+	enum class CallEdge { Start, End };
+
+	::MemoryUse getMemoryUse( const std::string& statmFilename )
+	{
+		std::ifstream inputFile( statmFilename );
+		if( !inputFile.is_open() ) throw std::runtime_error( "Unable to open "+statmFilename );
 
 	    std::string fileContents( std::istreambuf_iterator<char>(inputFile), (std::istreambuf_iterator<char>()) );
 	    inputFile.close();
 
 	    std::vector<std::string> columns;
 	    boost::split(columns, fileContents, boost::is_any_of(" "));
-	    if( columns.size()<2 ) throw std::runtime_error( "Unable to split the columns in /proc/"+pid+"/statm properly" );
+	    if( columns.size()<2 ) throw std::runtime_error( "Unable to split the columns in "+statmFilename+" properly" );
 
 	    // First column is size, second is RSS. See http://linux.die.net/man/5/proc.
 	    // Note that statm reports in mutiples of the page size, so need to multiply
@@ -70,24 +163,126 @@ namespace
 	    return std::stof(columns[0]);
 	}
 
-	/** @brief Dumps the current RSS and VmSize to std out, prefixed by the given string */
-	void dumpRSS( std::ostream& output, const std::string& pid, const std::string& prefix )
+	/** @brief Adds a module call to the lumi and run totals.
+	 *
+	 * The start and end of a module call always happen on the same thread, so a thread local stack is
+	 * enough to pair them up. Note that RSS is for the whole process, so when several threads are running
+	 * modules the growth of each module includes whatever the others did at the same time.
+	 */
+	void addToTotals( const edm::ModuleDescription& description, const std::shared_ptr<::DumpSettings>& pSettings, ::CallEdge edge, int rss )
+	{
+		::RSSAndTime used;
+		bool isCallEnd=false;
+		if( edge==::CallEdge::Start ) ::threadLocal_moduleCallStack.push()=::RSSAndTime( rss );
+		else
+		{
+			used=::RSSAndTime( rss );
+			isCallEnd=::threadLocal_moduleCallStack.pop( used ); // Now exclusive of any nested calls
+		}
+
+		std::lock_guard<std::mutex> lock( pSettings->totalsMutex );
+		pSettings->lumi.addSample( rss );
+		pSettings->run.addSample( rss );
+		if( !isCallEnd ) return;
+
+		pSettings->lumi.addModuleCall( description.id(), used.rss, used.seconds );
+		pSettings->run.addModuleCall( description.id(), used.rss, used.seconds );
+	}
+
+	/** @brief Dumps the current RSS and VmSize to std out for the module, if it's one being analysed
+	 *
+	 * The transition name is a string literal and pTransitionNumber points to the event, lumi or run counter
+	 * (or is null). Nothing is formatted unless the module is being analysed.
+	 */
+	void dumpRSSForModuleDescription( const edm::ModuleDescription& description, const std::shared_ptr<::DumpSettings>& pSettings, ::CallEdge edge, const char* transitionName, const size_t* pTransitionNumber )
 	{
-		::MemoryUse currentUsage=::getMemoryUse( pid );
+		if( !pSettings->isAnalysed(description) ) return;
+
+		::MemoryUse currentUsage=::getMemoryUse( pSettings->statmFilename );
 		float systemLoad=getSystemLoad();
 
-		output << prefix << " RSS/KiB " << currentUsage.rss << " Size/KiB " << currentUsage.size << " Load " << systemLoad << "\n";
+		std::cout << " *RSSDUMP* " << markstools::services::TransitionName(transitionName,pTransitionNumber) << " " << description.moduleLabel() << " " << description.moduleName()
+				<< " RSS/KiB " << currentUsage.rss << " Size/KiB " << currentUsage.size << " Load " << systemLoad << "\n";
+
+		::addToTotals( description, pSettings, edge, currentUsage.rss );
 	}
 
-	void dumpRSSForModuleDescription( const edm::ModuleDescription& description, const std::string& pid, std::function<std::string()> methodNameFunctor )
+	/** @brief Prints a one line summary of the window, with the modules that grew the most first. The ID is e.g. "Run 1 Lumi 12". */
+	void printWindowSummary( const char* tag, const std::string& id, const ::Window& window, int endRSS, const std::shared_ptr<::DumpSettings>& pSettings )
 	{
-		::dumpRSS( std::cout, pid, " *RSSDUMP* "+methodNameFunctor()+" "+description.moduleLabel()+" "+description.moduleName() );
+		std::vector<std::pair<int,unsigned int> > growthAndId;
+		for( unsigned int moduleId=0; moduleId<window.moduleGrowthById.size(); ++moduleId )
+		{
+			if( window.moduleGrowthById[moduleId]>0 ) growthAndId.push_back( std::make_pair(window.moduleGrowthById[moduleId],moduleId) );
+		}
+		size_t numberToPrint=std::min( growthAndId.size(), pSettings->topGrowthModules );
+		std::partial_sort( growthAndId.begin(), growthAndId.begin()+numberToPrint, growthAndId.end(), std::greater<std::pair<int,unsigned int> >() );
+
+		std::cout << " " << tag << " " << id << " Start_RSS/KiB " << window.startRSS << " End_RSS/KiB " << endRSS
+				<< " Peak_RSS/KiB " << std::max(window.peakRSS,endRSS) << " Growth/KiB " << endRSS-window.startRSS << " ModuleTime/s " << window.moduleSeconds
+				<< " Top_growth/KiB";
+		for( size_t index=0; index<numberToPrint; ++index ) std::cout << " " << pSettings->moduleLabelById[growthAndId[index].second] << " " << growthAndId[index].first;
+		std::cout << "\n";
+	}
+
+	void beginLumi( const std::shared_ptr<::DumpSettings>& pSettings )
+	{
+		int rss=::getMemoryUse( pSettings->statmFilename ).rss;
+		std::lock_guard<std::mutex> lock( pSettings->totalsMutex );
+		pSettings->lumi.begin( rss );
+	}
+
+	void beginRun( const std::shared_ptr<::DumpSettings>& pSettings )
+	{
+		int rss=::getMemoryUse( pSettings->statmFilename ).rss;
+		std::lock_guard<std::mutex> lock( pSettings->totalsMutex );
+		pSettings->run.begin( rss );
+	}
+
+	/** @brief Prints the lumi summary, and warns if the RSS has been growing too fast over the last few lumis */
+	void endLumi( const std::shared_ptr<::DumpSettings>& pSettings, unsigned int runNumber, unsigned int lumiNumber )
+	{
+		int rss=::getMemoryUse( pSettings->statmFilename ).rss;
+		std::string id="Run "+std::to_string(runNumber)+" Lumi "+std::to_string(lumiNumber);
+		std::lock_guard<std::mutex> lock( pSettings->totalsMutex );
+		::printWindowSummary( "*RSSLUMI*", id, pSettings->lumi, rss, pSettings );
+		pSettings->lumi.end( rss );
+
+		if( pSettings->growthWarningKiBPerLumi<=0 || pSettings->growthWarningLumis==0 ) return;
+		std::deque<int>& lumiEndRSS=pSettings->lumiEndRSS;
+		lumiEndRSS.push_back( rss );
+		if( lumiEndRSS.size()>pSettings->growthWarningLumis+1 ) lumiEndRSS.pop_front();
+		if( lumiEndRSS.size()<pSettings->growthWarningLumis+1 ) return;
+
+		double growthPerLumi=double( lumiEndRSS.back()-lumiEndRSS.front() )/pSettings->growthWarningLumis;
+		if( growthPerLumi>pSettings->growthWarningKiBPerLumi )
+		{
+			edm::LogWarning("CheckRSSService") << "RSS has grown by " << growthPerLumi/1024 << " MiB per lumi over the last " << pSettings->growthWarningLumis
+					<< " lumis, to " << rss/1024 << " MiB at the end of " << id << ". The limit is " << pSettings->growthWarningKiBPerLumi/1024 << " MiB per lumi.";
+			// Only keep the latest so that it doesn't warn again until there have been another growthWarningLumis lumis
+			lumiEndRSS.erase( lumiEndRSS.begin(), lumiEndRSS.end()-1 );
+		}
+	}
+
+	void endRun( const std::shared_ptr<::DumpSettings>& pSettings, unsigned int runNumber )
+	{
+		int rss=::getMemoryUse( pSettings->statmFilename ).rss;
+		std::lock_guard<std::mutex> lock( pSettings->totalsMutex );
+		::printWindowSummary( "*RSSRUN*", "Run "+std::to_string(runNumber), pSettings->run, rss, pSettings );
+		pSettings->run.end( rss );
+	}
+
+	/** @brief Works out whether the module should be analysed, then dumps the RSS at the start of its construction */
+	void selectModuleAndDumpRSS( const edm::ModuleDescription& description, const std::shared_ptr<::DumpSettings>& pSettings )
+	{
+		pSettings->selectModule( description );
+		::dumpRSSForModuleDescription( description, pSettings, ::CallEdge::Start, "Start_Construction", nullptr );
 	}
 
 #ifdef USE_NEW_ACTIVITYREGISTRY_SIGNALS
-	void dumpRSSForCallingContext( edm::ModuleCallingContext const& mcc, const std::string& pid, std::function<std::string()> methodNameFunctor )
+	void dumpRSSForCallingContext( edm::ModuleCallingContext const& mcc, const std::shared_ptr<::DumpSettings>& pSettings, ::CallEdge edge, const char* transitionName, const size_t* pTransitionNumber )
 	{
-		::dumpRSSForModuleDescription( *mcc.moduleDescription(), pid, methodNameFunctor );
+		::dumpRSSForModuleDescription( *mcc.moduleDescription(), pSettings, edge, transitionName, pTransitionNumber );
 	}
 #endif
 
@@ -97,69 +292,80 @@ namespace
 markstools::services::CheckRSSService::CheckRSSService( const edm::ParameterSet& parameterSet, edm::ActivityRegistry& activityRegister )
 	: eventNumber_(0), runNumber_(0), lumiNumber_(0)
 {
-	std::string pid=std::to_string( getpid() );
 	::global_pageSizeInKb=sysconf(_SC_PAGESIZE)/1024;
 
-	activityRegister.watchPreModuleConstruction( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pid, []{return "Start_Construction";} )  );
-	activityRegister.watchPostModuleConstruction( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pid, []{return "End_Construction";} ) );
+	// Shared between all of the callbacks, which keep it alive
+	std::shared_ptr<::DumpSettings> pSettings=std::make_shared<::DumpSettings>();
+	pSettings->statmFilename="/proc/"+std::to_string( getpid() )+"/statm";
+	if( parameterSet.exists("modulesToAnalyse") ) pSettings->modulesToAnalyse=parameterSet.getParameter<std::vector<std::string> >("modulesToAnalyse");
+	if( parameterSet.exists("topGrowthModules") ) pSettings->topGrowthModules=parameterSet.getParameter<unsigned int>("topGrowthModules");
+	if( parameterSet.exists("growthWarningLumis") ) pSettings->growthWarningLumis=parameterSet.getParameter<unsigned int>("growthWarningLumis");
+	if( parameterSet.exists("growthWarningMiBPerLumi") ) pSettings->growthWarningKiBPerLumi=parameterSet.getParameter<double>("growthWarningMiBPerLumi")*1024;
+
+	activityRegister.watchPreModuleConstruction( std::bind( &::selectModuleAndDumpRSS, std::placeholders::_1, pSettings ) );
+	activityRegister.watchPostModuleConstruction( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pSettings, ::CallEdge::End, "End_Construction", nullptr ) );
 
-	activityRegister.watchPreModuleBeginJob( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pid, []{return "Start_BeginJob";} ) );
-	activityRegister.watchPostModuleBeginJob( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pid, []{return "End_BeginJob";} ) );
+	activityRegister.watchPreModuleBeginJob( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pSettings, ::CallEdge::Start, "Start_BeginJob", nullptr ) );
+	activityRegister.watchPostModuleBeginJob( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pSettings, ::CallEdge::End, "End_BeginJob", nullptr ) );
 
-	activityRegister.watchPreModuleEndJob( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pid, []{return "Start_EndJob";} ) );
-	activityRegister.watchPostModuleEndJob( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pid, []{return "End_EndJob";} ) );
+	activityRegister.watchPreModuleEndJob( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pSettings, ::CallEdge::Start, "Start_EndJob", nullptr ) );
+	activityRegister.watchPostModuleEndJob( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pSettings, ::CallEdge::End, "End_EndJob", nullptr ) );
 
 #ifdef USE_NEW_ACTIVITYREGISTRY_SIGNALS
 	activityRegister.watchPostEvent( [&](edm::StreamContext const&){++eventNumber_;} );
-	activityRegister.watchPostGlobalEndRun( [&](edm::GlobalContext const&){++runNumber_;} );
-	activityRegister.watchPostGlobalEndLumi( [&](edm::GlobalContext const&){++lumiNumber_;} );
-
-	activityRegister.watchPreModuleEvent( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, [&]{return "Start_Event"+std::to_string(eventNumber_);} ) );
-	activityRegister.watchPostModuleEvent( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, [&]{return "End_Event"+std::to_string(eventNumber_);} ) );
-
-	activityRegister.watchPreModuleBeginStream( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, []{return "Start_ModuleBeginStream";} ) );
-	activityRegister.watchPostModuleBeginStream( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, []{return "End_ModuleBeginStream";} ) );
-	activityRegister.watchPreModuleEndStream( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, []{return "Start_ModuleEndStream";} ) );
-	activityRegister.watchPostModuleEndStream( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, []{return "End_ModuleEndStream";} ) );
-
-	activityRegister.watchPreModuleStreamBeginRun( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, [&]{return "Start_ModuleStreamBeginRun"+std::to_string(runNumber_);} ) );
-	activityRegister.watchPostModuleStreamBeginRun( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, [&]{return "End_ModuleStreamBeginRun"+std::to_string(runNumber_);} ) );
-	activityRegister.watchPreModuleStreamEndRun( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, [&]{return "Start_ModuleStreamEndRun"+std::to_string(runNumber_);} ) );
-	activityRegister.watchPostModuleStreamEndRun( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, [&]{return "End_ModuleStreamEndRun"+std::to_string(runNumber_);} ) );
-
-	activityRegister.watchPreModuleStreamBeginLumi( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, [&]{return "Start_ModuleStreamBeginLumi"+std::to_string(lumiNumber_);} ) );
-	activityRegister.watchPostModuleStreamBeginLumi( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, [&]{return "End_ModuleStreamBeginLumi"+std::to_string(lumiNumber_);} ) );
-	activityRegister.watchPreModuleStreamEndLumi( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, [&]{return "Start_ModuleStreamEndLumi"+std::to_string(lumiNumber_);} ) );
-	activityRegister.watchPostModuleStreamEndLumi( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, [&]{return "End_ModuleStreamEndLumi"+std::to_string(lumiNumber_);} ) );
-
-	activityRegister.watchPreModuleGlobalBeginRun( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, [&]{return "Start_ModuleGlobalBeginRun"+std::to_string(runNumber_);} ) );
-	activityRegister.watchPostModuleGlobalBeginRun( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, [&]{return "End_ModuleGlobalBeginRun"+std::to_string(runNumber_);} ) );
-	activityRegister.watchPreModuleGlobalEndRun( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, [&]{return "Start_ModuleGlobalEndRun"+std::to_string(runNumber_);} ) );
-	activityRegister.watchPostModuleGlobalEndRun( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, [&]{return "End_ModuleGlobalEndRun"+std::to_string(runNumber_);} ) );
-
-	activityRegister.watchPreModuleGlobalBeginLumi( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, [&]{return "Start_ModuleGlobalBeginLumi"+std::to_string(lumiNumber_);} ) );
-	activityRegister.watchPostModuleGlobalBeginLumi( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, [&]{return "End_ModuleGlobalBeginLumi"+std::to_string(lumiNumber_);} ) );
-	activityRegister.watchPreModuleGlobalEndLumi( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, [&]{return "Start_ModuleGlobalEndLumi"+std::to_string(lumiNumber_);} ) );
-	activityRegister.watchPostModuleGlobalEndLumi( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pid, [&]{return "End_ModuleGlobalEndLumi"+std::to_string(lumiNumber_);} ) );
+	activityRegister.watchPreGlobalBeginRun( [pSettings](edm::GlobalContext const&){::beginRun(pSettings);} );
+	activityRegister.watchPreGlobalBeginLumi( [pSettings](edm::GlobalContext const&){::beginLumi(pSettings);} );
+	activityRegister.watchPostGlobalEndRun( [&,pSettings](edm::GlobalContext const& context){::endRun(pSettings,context.luminosityBlockID().run());++runNumber_;} );
+	activityRegister.watchPostGlobalEndLumi( [&,pSettings](edm::GlobalContext const& context){::endLumi(pSettings,context.luminosityBlockID().run(),context.luminosityBlockID().luminosityBlock());++lumiNumber_;} );
+
+	activityRegister.watchPreModuleEvent( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::Start, "Start_Event", &eventNumber_ ) );
+	activityRegister.watchPostModuleEvent( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::End, "End_Event", &eventNumber_ ) );
+
+	activityRegister.watchPreModuleBeginStream( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::Start, "Start_ModuleBeginStream", nullptr ) );
+	activityRegister.watchPostModuleBeginStream( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::End, "End_ModuleBeginStream", nullptr ) );
+	activityRegister.watchPreModuleEndStream( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::Start, "Start_ModuleEndStream", nullptr ) );
+	activityRegister.watchPostModuleEndStream( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::End, "End_ModuleEndStream", nullptr ) );
+
+	activityRegister.watchPreModuleStreamBeginRun( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::Start, "Start_ModuleStreamBeginRun", &runNumber_ ) );
+	activityRegister.watchPostModuleStreamBeginRun( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::End, "End_ModuleStreamBeginRun", &runNumber_ ) );
+	activityRegister.watchPreModuleStreamEndRun( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::Start, "Start_ModuleStreamEndRun", &runNumber_ ) );
+	activityRegister.watchPostModuleStreamEndRun( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::End, "End_ModuleStreamEndRun", &runNumber_ ) );
+
+	activityRegister.watchPreModuleStreamBeginLumi( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::Start, "Start_ModuleStreamBeginLumi", &lumiNumber_ ) );
+	activityRegister.watchPostModuleStreamBeginLumi( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::End, "End_ModuleStreamBeginLumi", &lumiNumber_ ) );
+	activityRegister.watchPreModuleStreamEndLumi( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::Start, "Start_ModuleStreamEndLumi", &lumiNumber_ ) );
+	activityRegister.watchPostModuleStreamEndLumi( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::End, "End_ModuleStreamEndLumi", &lumiNumber_ ) );
+
+	activityRegister.watchPreModuleGlobalBeginRun( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::Start, "Start_ModuleGlobalBeginRun", &runNumber_ ) );
+	activityRegister.watchPostModuleGlobalBeginRun( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::End, "End_ModuleGlobalBeginRun", &runNumber_ ) );
+	activityRegister.watchPreModuleGlobalEndRun( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::Start, "Start_ModuleGlobalEndRun", &runNumber_ ) );
+	activityRegister.watchPostModuleGlobalEndRun( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::End, "End_ModuleGlobalEndRun", &runNumber_ ) );
+
+	activityRegister.watchPreModuleGlobalBeginLumi( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::Start, "Start_ModuleGlobalBeginLumi", &lumiNumber_ ) );
+	activityRegister.watchPostModuleGlobalBeginLumi( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::End, "End_ModuleGlobalBeginLumi", &lumiNumber_ ) );
+	activityRegister.watchPreModuleGlobalEndLumi( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::Start, "Start_ModuleGlobalEndLumi", &lumiNumber_ ) );
+	activityRegister.watchPostModuleGlobalEndLumi( std::bind( &::dumpRSSForCallingContext, std::placeholders::_2, pSettings, ::CallEdge::End, "End_ModuleGlobalEndLumi", &lumiNumber_ ) );
 #else
 	activityRegister.watchPostProcessEvent( [&](const edm::Event&,const edm::EventSetup&){++eventNumber_;} );
-	activityRegister.watchPostEndLumi( [&](edm::LuminosityBlock const&, edm::EventSetup const&){++lumiNumber_;} );
-	activityRegister.watchPostEndRun( [&](edm::Run const&, edm::EventSetup const&){++runNumber_;} );
+	activityRegister.watchPreBeginRun( [pSettings](edm::RunID const&, edm::Timestamp const&){::beginRun(pSettings);} );
+	activityRegister.watchPreBeginLumi( [pSettings](edm::LuminosityBlockID const&, edm::Timestamp const&){::beginLumi(pSettings);} );
+	activityRegister.watchPostEndLumi( [&,pSettings](edm::LuminosityBlock const& lumi, edm::EventSetup const&){::endLumi(pSettings,lumi.id().run(),lumi.id().luminosityBlock());++lumiNumber_;} );
+	activityRegister.watchPostEndRun( [&,pSettings](edm::Run const& run, edm::EventSetup const&){::endRun(pSettings,run.id().run());++runNumber_;} );
 
-	activityRegister.watchPreModuleBeginRun( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pid, [&]{return "Start_BeginRun"+std::to_string(runNumber_);} ) );
-	activityRegister.watchPostModuleBeginRun( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pid, [&]{return "End_BeginRun"+std::to_string(runNumber_);} ) );
+	activityRegister.watchPreModuleBeginRun( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pSettings, ::CallEdge::Start, "Start_BeginRun", &runNumber_ ) );
+	activityRegister.watchPostModuleBeginRun( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pSettings, ::CallEdge::End, "End_BeginRun", &runNumber_ ) );
 
-	activityRegister.watchPreModuleBeginLumi( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pid, [&]{return "Start_BeginLumi"+std::to_string(lumiNumber_);} ) );
-	activityRegister.watchPostModuleBeginLumi( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pid, [&]{return "End_BeginLumi"+std::to_string(lumiNumber_);} ) );
+	activityRegister.watchPreModuleBeginLumi( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pSettings, ::CallEdge::Start, "Start_BeginLumi", &lumiNumber_ ) );
+	activityRegister.watchPostModuleBeginLumi( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pSettings, ::CallEdge::End, "End_BeginLumi", &lumiNumber_ ) );
 
-	activityRegister.watchPreModule( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pid, [&]{return "Start_Event"+std::to_string(eventNumber_);} ) );
-	activityRegister.watchPostModule( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pid, [&]{return "End_Event"+std::to_string(eventNumber_);} ) );
+	activityRegister.watchPreModule( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pSettings, ::CallEdge::Start, "Start_Event", &eventNumber_ ) );
+	activityRegister.watchPostModule( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pSettings, ::CallEdge::End, "End_Event", &eventNumber_ ) );
 
-	activityRegister.watchPreModuleEndLumi( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pid, [&]{return "Start_EndLumi"+std::to_string(lumiNumber_);} ) );
-	activityRegister.watchPostModuleEndLumi( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pid, [&]{return "End_EndLumi"+std::to_string(lumiNumber_);} ) );
+	activityRegister.watchPreModuleEndLumi( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pSettings, ::CallEdge::Start, "Start_EndLumi", &lumiNumber_ ) );
+	activityRegister.watchPostModuleEndLumi( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pSettings, ::CallEdge::End, "End_EndLumi", &lumiNumber_ ) );
 
-	activityRegister.watchPreModuleEndRun( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pid, [&]{return "Start_EndRun"+std::to_string(runNumber_);} ) );
-	activityRegister.watchPostModuleEndRun( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pid, [&]{return "End_EndRun"+std::to_string(runNumber_);} ) );
+	activityRegister.watchPreModuleEndRun( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pSettings, ::CallEdge::Start, "Start_EndRun", &runNumber_ ) );
+	activityRegister.watchPostModuleEndRun( std::bind( &::dumpRSSForModuleDescription, std::placeholders::_1, pSettings, ::CallEdge::End, "End_EndRun", &runNumber_ ) );
 #endif
 }
 
@@ -15,6 +15,9 @@ namespace markstools
 	namespace services
 	{
 		/** @brief CMSSW service that times the execution of modules
+		 *
+		 * Also keeps totals for each lumi and run, printed as " *RSSLUMI* " and " *RSSRUN* " lines when they
+		 * end, and gives a MessageLogger warning if the RSS keeps growing faster than "growthWarningMiBPerLumi".
 		 *
 		 * @author Mark Grimes (mark.grimes@bristol.ac.uk)
 		 * @date 31/May/2014
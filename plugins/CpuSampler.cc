@@ -0,0 +1,413 @@
+#include "CpuSampler.h"
+#include "MarksTools/Benchmarking/interface/SymbolName.h"
+#include "MarksTools/Benchmarking/interface/StackWalk.h"
+
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <ucontext.h>
+#include <cerrno>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <iostream>
+#include <DataFormats/Provenance/interface/ModuleDescription.h>
+
+// Older glibc doesn't give the field a proper name
+#ifndef sigev_notify_thread_id
+#	define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+//
+// Use the unnamed namespace for things only used in this file.
+//
+namespace
+{
+	/// The deepest stack that will be recorded. Anything deeper is truncated at the outermost end.
+	const int maximumStackDepth=64;
+
+#if defined(__x86_64__) || defined(__aarch64__)
+	/// The stack is walked from the interrupted registers, so there's nothing of the signal handler's to skip
+	const int framesToSkip=0;
+#else
+	/// The stack is walked from the signal handler, so the first frame is the return into the kernel's signal trampoline
+	const int framesToSkip=1;
+#endif
+
+	/// Number of samples each thread can hold before they're moved into its stack table. Samples beyond this are dropped and counted.
+	const size_t bufferCapacity=4096;
+
+	const char* transitionNames[]={ "beginJob", "beginRun", "beginLumi", "event", "endLumi", "endRun", "endJob" };
+	const unsigned int numberOfTransitions=sizeof(transitionNames)/sizeof(transitionNames[0]);
+
+	struct StackHash
+	{
+		size_t operator()( const std::vector<void*>& stack ) const
+		{
+			size_t hash=stack.size();
+			for( const auto pointer : stack ) hash=hash*31+reinterpret_cast<uintptr_t>(pointer);
+			return hash;
+		}
+	};
+	typedef std::unordered_map<std::vector<void*>,int64_t,StackHash> StackCounts; ///< Values are CPU nanoseconds
+
+	/** @brief CPU time used by the calling thread in nanoseconds. clock_gettime is async signal safe. */
+	int64_t threadCpuTime()
+	{
+		struct timespec time;
+		clock_gettime( CLOCK_THREAD_CPUTIME_ID, &time );
+		return static_cast<int64_t>(time.tv_sec)*1000000000+time.tv_nsec;
+	}
+
+	/** @brief The samples and total CPU for one module and transition */
+	struct TagStatistics
+	{
+		size_t samples;
+		int64_t cpuTime; ///< Nanoseconds, including what was used after the last sample of each call
+		TagStatistics() : samples(0), cpuTime(0) {}
+	};
+
+	struct Sample
+	{
+		uint32_t tag;
+		int64_t weight; ///< Thread CPU nanoseconds since the previous sample, since CPU timers only fire on the scheduler tick
+		int depth;
+		void* frames[::maximumStackDepth];
+	};
+
+	/** @brief Everything for one thread. The signal handler only touches currentTag, the buffer and its indices. */
+	struct ThreadSamples
+	{
+		timer_t timer;
+		bool hasTimer;
+		bool armed;
+		struct itimerspec remaining; ///< What's left of the sample interval from the last time the timer was disarmed
+		/// Zero means don't sample, otherwise one more than moduleIndex*numberOfTransitions+transition
+		std::atomic<uint32_t> currentTag;
+		std::atomic<int64_t> lastSampleTime; ///< Thread CPU time of the last sample, or of the start of the call if there hasn't been one
+		/// The tags to go back to as each call finishes. Only non-empty while a selected module is somewhere in the calls on this thread.
+		std::vector<uint32_t> tagStack;
+
+		std::unique_ptr<::Sample[]> buffer;
+		std::atomic<size_t> writeIndex; ///< Only changed by the signal handler
+		std::atomic<size_t> readIndex; ///< Only changed outside the signal handler
+		std::atomic<size_t> droppedSamples;
+
+		std::map<uint32_t,::StackCounts> stacks; ///< Keyed on tag
+		std::map<uint32_t,::TagStatistics> statistics; ///< Keyed on tag
+
+		ThreadSamples() : hasTimer(false), armed(false), currentTag(0), lastSampleTime(0), buffer( new ::Sample[::bufferCapacity] ), writeIndex(0), readIndex(0), droppedSamples(0) {}
+	};
+
+	/// Set the first time the thread runs a selected module. The thread_local is touched before the timer is ever armed, so it's
+	/// already allocated by the time the signal handler reads it (dynamic TLS in a plugin library can allocate on first use).
+	thread_local ThreadSamples* pThreadSamples=nullptr;
+
+	/** @brief Walks the frame pointers of the code the signal interrupted, innermost first. Only reads memory, so it's safe in the signal handler.
+	 *
+	 * If the interrupted function hadn't set up its frame yet (or doesn't keep one) its caller is missed, but
+	 * the sample is still in the right function since the program counter is always the first frame. */
+	int recordInterruptedStack( void* signalContext, void** frames, int maximumDepth )
+	{
+		const ucontext_t* pContext=static_cast<const ucontext_t*>( signalContext );
+#if defined(__x86_64__)
+		return markstools::services::walkFramePointers( reinterpret_cast<void*>( pContext->uc_mcontext.gregs[REG_RIP] ),
+				reinterpret_cast<void*>( pContext->uc_mcontext.gregs[REG_RBP] ), frames, maximumDepth );
+#elif defined(__aarch64__)
+		return markstools::services::walkFramePointers( reinterpret_cast<void*>( pContext->uc_mcontext.pc ),
+				reinterpret_cast<void*>( pContext->uc_mcontext.regs[29] ), frames, maximumDepth );
+#else
+		(void)pContext; // Don't know where the registers are, so start from here and rely on the chain going through the trampoline
+		return markstools::services::walkFramePointersFromHere( frames, maximumDepth );
+#endif
+	}
+
+	void profileSignalHandler( int, siginfo_t*, void* signalContext )
+	{
+		int savedErrno=errno;
+		::ThreadSamples* pThread=::pThreadSamples;
+		if( pThread )
+		{
+			uint32_t tag=pThread->currentTag.load( std::memory_order_relaxed );
+			size_t writeIndex=pThread->writeIndex.load( std::memory_order_relaxed );
+			if( tag==0 ) {} // Signal arrived just as the timer was being disarmed
+			else if( writeIndex-pThread->readIndex.load( std::memory_order_acquire )>=::bufferCapacity ) pThread->droppedSamples.fetch_add( 1, std::memory_order_relaxed );
+			else
+			{
+				::Sample& sample=pThread->buffer[writeIndex % ::bufferCapacity];
+				sample.tag=tag;
+				// Exchange rather than load and store, so that it all still adds up if this interrupted switchTag
+				int64_t now=::threadCpuTime();
+				sample.weight=now-pThread->lastSampleTime.exchange( now );
+				sample.depth=::recordInterruptedStack( signalContext, sample.frames, ::maximumStackDepth );
+				pThread->writeIndex.store( writeIndex+1, std::memory_order_release );
+			}
+		}
+		errno=savedErrno;
+	}
+
+	/** @brief Moves the samples out of the thread's buffer and into its stack table. Never called from the signal handler. */
+	void drain( ::ThreadSamples& thread )
+	{
+		size_t writeIndex=thread.writeIndex.load( std::memory_order_acquire );
+		size_t readIndex=thread.readIndex.load( std::memory_order_relaxed );
+		for( ; readIndex!=writeIndex; ++readIndex )
+		{
+			const ::Sample& sample=thread.buffer[readIndex % ::bufferCapacity];
+			::TagStatistics& statistics=thread.statistics[sample.tag];
+			++statistics.samples;
+			statistics.cpuTime+=sample.weight;
+			if( sample.depth>::framesToSkip ) thread.stacks[sample.tag][ std::vector<void*>( sample.frames+::framesToSkip, sample.frames+sample.depth ) ]+=sample.weight;
+		}
+		thread.readIndex.store( readIndex, std::memory_order_release );
+	}
+
+} // end of the unnamed namespace
+
+//
+// Define the pimple class
+//
+namespace markstools
+{
+	namespace services
+	{
+		class CpuSamplerPimple
+		{
+		public:
+			CpuSamplerPimple( unsigned int sampleInterval, const std::vector<std::string>& modulesToProfile );
+			~CpuSamplerPimple();
+			/// @brief Returns -1 for modules that aren't being profiled
+			int moduleIndex( const edm::ModuleDescription& description ) const
+			{
+				return description.id()<moduleIndexById_.size() ? moduleIndexById_[description.id()] : -1;
+			}
+			::ThreadSamples* threadSamples();
+			/// @brief Gives the CPU since the last sample to the current tag, then swaps to the new one and arms or disarms the timer to suit
+			void switchTag( ::ThreadSamples& thread, uint32_t newTag );
+			void setArmed( ::ThreadSamples& thread, bool arm );
+			void collect();
+
+			unsigned int sampleInterval_; ///< In microseconds
+			std::vector<std::string> modulesToProfile_;
+			std::vector<int> moduleIndexById_; ///< Filled at module construction, so read without a lock afterwards
+			std::vector<std::string> moduleLabels_;
+			std::vector<std::string> moduleTypes_;
+			struct sigaction previousAction_;
+
+			std::mutex mutex_; ///< Protects everything below
+			std::vector<std::unique_ptr<::ThreadSamples> > threadSamples_;
+			std::map<uint32_t,::StackCounts> stacks_; ///< All the threads' stacks, keyed on tag. Only filled at the end of the job.
+			std::map<uint32_t,::TagStatistics> statistics_; ///< All the threads' totals, keyed on tag. Only filled at the end of the job.
+			size_t droppedSamples_;
+			bool timerFailureReported_;
+		}; // end of the CpuSamplerPimple class
+
+	} // end of the markstools::services namespace
+} // end of the markstools namespace
+
+markstools::services::CpuSampler::CpuSampler( unsigned int sampleInterval, const std::vector<std::string>& modulesToProfile )
+	: pImple_( new CpuSamplerPimple(sampleInterval,modulesToProfile) )
+{
+	// No operation besides the initialiser list
+}
+
+markstools::services::CpuSampler::~CpuSampler()
+{
+	delete pImple_;
+}
+
+void markstools::services::CpuSampler::selectModule( const edm::ModuleDescription& description )
+{
+	const std::vector<std::string>& modulesToProfile=pImple_->modulesToProfile_;
+	if( !modulesToProfile.empty() && std::find( modulesToProfile.begin(), modulesToProfile.end(), description.moduleLabel() )==modulesToProfile.end() ) return;
+
+	if( pImple_->moduleIndexById_.size()<=description.id() ) pImple_->moduleIndexById_.resize( description.id()+1, -1 );
+	pImple_->moduleIndexById_[description.id()]=pImple_->moduleLabels_.size();
+	pImple_->moduleLabels_.push_back( description.moduleLabel() );
+	pImple_->moduleTypes_.push_back( description.moduleName() );
+}
+
+void markstools::services::CpuSampler::preModule( const edm::ModuleDescription& description, Transition transition )
+{
+	int moduleIndex=pImple_->moduleIndex( description );
+	::ThreadSamples* pThread=::pThreadSamples;
+	// Nothing to do unless this module is selected, or is being called from inside one that is
+	if( moduleIndex<0 && ( pThread==nullptr || pThread->tagStack.empty() ) ) return;
+	if( pThread==nullptr ) pThread=pImple_->threadSamples();
+
+	uint32_t tag=( moduleIndex<0 ? 0 : moduleIndex*::numberOfTransitions+static_cast<unsigned int>(transition)+1 );
+	pThread->tagStack.push_back( pThread->currentTag.load(std::memory_order_relaxed) );
+	pImple_->switchTag( *pThread, tag );
+}
+
+void markstools::services::CpuSampler::postModule( const edm::ModuleDescription& description )
+{
+	::ThreadSamples* pThread=::pThreadSamples;
+	if( pThread==nullptr || pThread->tagStack.empty() ) return;
+
+	uint32_t previousTag=pThread->tagStack.back();
+	pThread->tagStack.pop_back();
+	pImple_->switchTag( *pThread, previousTag );
+	// Do the book keeping while the timer is off if possible, so that it doesn't get sampled
+	::drain( *pThread );
+}
+
+void markstools::services::CpuSampler::writeFoldedStacks( std::ostream& output )
+{
+	std::lock_guard<std::mutex> lock( pImple_->mutex_ );
+	pImple_->collect();
+
+	// Different return addresses in the same functions give the same line, so they're merged on the text
+	std::unordered_map<void*,std::string> symbolCache;
+	std::map<std::string,int64_t> foldedStacks;
+	for( const auto& tagAndStacks : pImple_->stacks_ )
+	{
+		size_t moduleIndex=(tagAndStacks.first-1)/::numberOfTransitions;
+		const char* transitionName=::transitionNames[(tagAndStacks.first-1) % ::numberOfTransitions];
+		for( const auto& stackAndCount : tagAndStacks.second )
+		{
+			std::string foldedStack=pImple_->moduleLabels_[moduleIndex]+";"+transitionName;
+			// The stacks have the innermost frame first, but the folded format wants the outermost first
+			for( auto iFrame=stackAndCount.first.rbegin(); iFrame!=stackAndCount.first.rend(); ++iFrame )
+			{
+				auto iSymbol=symbolCache.find( *iFrame );
+				if( iSymbol==symbolCache.end() ) iSymbol=symbolCache.insert( std::make_pair( *iFrame, markstools::services::symbolName(*iFrame) ) ).first;
+				foldedStack+=";"+iSymbol->second;
+			}
+			foldedStacks[foldedStack]+=stackAndCount.second;
+		}
+	}
+
+	// In microseconds of CPU
+	for( const auto& stackAndTime : foldedStacks ) output << stackAndTime.first << " " << (stackAndTime.second+500)/1000 << "\n";
+	output.flush();
+}
+
+void markstools::services::CpuSampler::printSummary( std::ostream& output )
+{
+	std::lock_guard<std::mutex> lock( pImple_->mutex_ );
+	pImple_->collect();
+
+	std::vector<::TagStatistics> moduleStatistics( pImple_->moduleLabels_.size() );
+	::TagStatistics total;
+	for( const auto& tagAndStatistics : pImple_->statistics_ )
+	{
+		::TagStatistics& module=moduleStatistics[(tagAndStatistics.first-1)/::numberOfTransitions];
+		module.samples+=tagAndStatistics.second.samples;
+		module.cpuTime+=tagAndStatistics.second.cpuTime;
+		total.samples+=tagAndStatistics.second.samples;
+		total.cpuTime+=tagAndStatistics.second.cpuTime;
+	}
+
+	for( size_t moduleIndex=0; moduleIndex<moduleStatistics.size(); ++moduleIndex )
+	{
+		if( moduleStatistics[moduleIndex].cpuTime==0 ) continue;
+		output << " *CPUSAMPLE* " << pImple_->moduleLabels_[moduleIndex] << "," << pImple_->moduleTypes_[moduleIndex]
+				<< "," << moduleStatistics[moduleIndex].samples << "," << moduleStatistics[moduleIndex].cpuTime*1e-9 << "\n";
+	}
+	// The number of samples dropped because a buffer was full goes in place of the module type
+	output << " *CPUSAMPLE* TOTAL," << pImple_->droppedSamples_ << "," << total.samples << "," << total.cpuTime*1e-9 << std::endl;
+}
+
+markstools::services::CpuSamplerPimple::CpuSamplerPimple( unsigned int sampleInterval, const std::vector<std::string>& modulesToProfile )
+	: sampleInterval_( std::max(sampleInterval,1u) ), modulesToProfile_(modulesToProfile), droppedSamples_(0), timerFailureReported_(false)
+{
+	struct sigaction action;
+	action.sa_sigaction=&::profileSignalHandler;
+	action.sa_flags=SA_SIGINFO | SA_RESTART;
+	sigemptyset( &action.sa_mask );
+	if( sigaction( SIGPROF, &action, &previousAction_ )!=0 ) std::cerr << " *** ModuleTimer: unable to install the SIGPROF handler, so there will be no CPU profile." << std::endl;
+	else if( previousAction_.sa_handler!=SIG_DFL && previousAction_.sa_handler!=SIG_IGN ) std::cerr << " *** ModuleTimer: something else (igprof?) was already using SIGPROF. The CPU profile has taken it over." << std::endl;
+}
+
+markstools::services::CpuSamplerPimple::~CpuSamplerPimple()
+{
+	for( const auto& pThread : threadSamples_ )
+	{
+		if( pThread->hasTimer ) timer_delete( pThread->timer );
+	}
+	sigaction( SIGPROF, &previousAction_, nullptr );
+}
+
+::ThreadSamples* markstools::services::CpuSamplerPimple::threadSamples()
+{
+	std::unique_ptr<::ThreadSamples> pNewThread( new ::ThreadSamples );
+	pNewThread->remaining.it_interval.tv_sec=sampleInterval_/1000000;
+	pNewThread->remaining.it_interval.tv_nsec=(sampleInterval_%1000000)*1000;
+	pNewThread->remaining.it_value=pNewThread->remaining.it_interval;
+
+	// The timer counts the CPU used by this thread only, and signals this thread only
+	struct sigevent event;
+	event.sigev_notify=SIGEV_THREAD_ID;
+	event.sigev_signo=SIGPROF;
+	event.sigev_notify_thread_id=syscall( SYS_gettid );
+	event.sigev_value.sival_ptr=nullptr;
+	pNewThread->hasTimer=( timer_create( CLOCK_THREAD_CPUTIME_ID, &event, &pNewThread->timer )==0 );
+
+	std::lock_guard<std::mutex> lock( mutex_ );
+	if( !pNewThread->hasTimer && !timerFailureReported_ )
+	{
+		std::cerr << " *** ModuleTimer: unable to create a per thread CPU timer, so some threads won't be profiled." << std::endl;
+		timerFailureReported_=true;
+	}
+	threadSamples_.push_back( std::move(pNewThread) );
+	::pThreadSamples=threadSamples_.back().get();
+	return ::pThreadSamples;
+}
+
+void markstools::services::CpuSamplerPimple::switchTag( ::ThreadSamples& thread, uint32_t newTag )
+{
+	uint32_t oldTag=thread.currentTag.load( std::memory_order_relaxed );
+	if( oldTag==newTag ) return;
+
+	int64_t now=::threadCpuTime();
+	if( oldTag!=0 ) thread.statistics[oldTag].cpuTime+=now-thread.lastSampleTime.exchange( now );
+	else thread.lastSampleTime.store( now );
+	thread.currentTag.store( newTag, std::memory_order_relaxed );
+	setArmed( thread, newTag!=0 );
+}
+
+void markstools::services::CpuSamplerPimple::setArmed( ::ThreadSamples& thread, bool arm )
+{
+	if( arm==thread.armed || !thread.hasTimer ) return;
+
+	if( arm ) timer_settime( thread.timer, 0, &thread.remaining, nullptr );
+	else
+	{
+		struct itimerspec disarm={ {0,0}, {0,0} };
+		struct itimerspec previous;
+		timer_settime( thread.timer, 0, &disarm, &previous );
+		// Carry over what's left so that calls shorter than the interval still get their share of samples
+		if( previous.it_value.tv_sec!=0 || previous.it_value.tv_nsec!=0 ) thread.remaining.it_value=previous.it_value;
+		else thread.remaining.it_value=thread.remaining.it_interval;
+	}
+	thread.armed=arm;
+}
+
+void markstools::services::CpuSamplerPimple::collect()
+{
+	// Only called at the end of the job when nothing else is running, so the threads' own tables can be read
+	for( const auto& pThread : threadSamples_ )
+	{
+		::drain( *pThread );
+		for( auto& tagAndStacks : pThread->stacks )
+		{
+			::StackCounts& destination=stacks_[tagAndStacks.first];
+			for( const auto& stackAndCount : tagAndStacks.second ) destination[stackAndCount.first]+=stackAndCount.second;
+		}
+		pThread->stacks.clear();
+		for( const auto& tagAndStatistics : pThread->statistics )
+		{
+			statistics_[tagAndStatistics.first].samples+=tagAndStatistics.second.samples;
+			statistics_[tagAndStatistics.first].cpuTime+=tagAndStatistics.second.cpuTime;
+		}
+		pThread->statistics.clear();
+		droppedSamples_+=pThread->droppedSamples.exchange( 0 );
+	}
+}
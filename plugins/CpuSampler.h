@@ -0,0 +1,73 @@
+#ifndef markstools_services_CpuSampler_h
+#define markstools_services_CpuSampler_h
+
+#include <string>
+#include <vector>
+#include <iosfwd>
+
+namespace edm
+{
+	class ModuleDescription;
+}
+
+namespace markstools
+{
+	namespace services
+	{
+		/** @brief Sampling CPU profiler that attributes each sample to the module running on the thread.
+		 *
+		 * Not a service in itself, ModuleTimer owns one of these if the "cpuProfileInterval" parameter is set.
+		 * Each thread gets its own POSIX timer on its CPU time clock that sends it SIGPROF every sampleInterval
+		 * microseconds of CPU it uses. The signal handler records the stack into a fixed size
+		 * ring buffer belonging to the thread, tagged with whichever module and transition the thread is
+		 * currently running. Only the thread writes to its own buffer, so no locks are needed; it's emptied
+		 * into a table of stacks after each selected module call.
+		 *
+		 * The timer is only armed while a selected module is running, so the other modules cost an index
+		 * lookup per call and nothing while they run. Whatever was left of the interval when it's disarmed is
+		 * carried over to the next selected call, so short calls are still sampled in proportion to their CPU.
+		 *
+		 * CPU timers are only checked on the scheduler tick, so the real interval is never shorter than that
+		 * (typically 1-4 ms). Each sample is therefore weighted by the thread's CPU time since the previous one
+		 * rather than counted, and the CPU used after the last sample in a call is added to the module's total,
+		 * so the totals are exact even when only the stacks are a sample.
+		 *
+		 * The stack is taken by walking the frame pointers from the interrupted registers (see StackWalk.h)
+		 * rather than with backtrace(). backtrace() isn't async signal safe even once libgcc_s is loaded: the
+		 * unwinder takes the loader lock to find the unwind tables, so a sample landing in dlopen or in another
+		 * unwind on the same thread would deadlock. The price is that code built without frame pointers gives
+		 * shorter stacks. Anything else that uses SIGPROF (e.g. igprof) can't be run at the same time.
+		 *
+		 * @author Mark Grimes (mark.grimes@bristol.ac.uk)
+		 * @date 19/Oct/2026
+		 */
+		class CpuSampler
+		{
+		public:
+			enum class Transition : unsigned int { BeginJob, BeginRun, BeginLumi, Event, EndLumi, EndRun, EndJob };
+
+			/// @brief An empty modulesToProfile means profile every module
+			CpuSampler( unsigned int sampleInterval, const std::vector<std::string>& modulesToProfile );
+			virtual ~CpuSampler();
+
+			/// @brief Works out once whether the module is selected. Must be called at module construction.
+			void selectModule( const edm::ModuleDescription& description );
+			void preModule( const edm::ModuleDescription& description, Transition transition );
+			void postModule( const edm::ModuleDescription& description );
+
+			/// @brief Writes "moduleLabel;transition;outermostFrame;...;innermostFrame microseconds" lines, as used by flamegraph.pl
+			void writeFoldedStacks( std::ostream& output );
+			/// @brief Prints " *CPUSAMPLE* " lines with the number of samples and the CPU seconds for each module
+			void printSummary( std::ostream& output );
+
+			CpuSampler( const CpuSampler& otherCpuSampler ) = delete;
+			CpuSampler& operator=( const CpuSampler& otherCpuSampler ) = delete;
+		private:
+			/// @brief Hide all the private members in a pimple. Google "pimple idiom" for details.
+			class CpuSamplerPimple* pImple_;
+		}; // end of class CpuSampler
+
+	} // end of namespace services
+} // end of namespace markstools
+
+#endif // end of #ifndef markstools_services_CpuSampler_h
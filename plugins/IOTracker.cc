@@ -0,0 +1,284 @@
+#include "IOTracker.h"
+#include "NestedCallStack.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <DataFormats/Provenance/interface/ModuleDescription.h>
+
+//
+// Use the unnamed namespace for things only used in this file.
+//
+namespace
+{
+	struct IOCounters
+	{
+		uint64_t rchar;
+		uint64_t wchar;
+		uint64_t syscr;
+		uint64_t syscw;
+		uint64_t readBytes;
+		uint64_t writeBytes;
+		double seconds; ///< Wall clock time, so that the rates can be worked out
+		IOCounters() : rchar(0), wchar(0), syscr(0), syscw(0), readBytes(0), writeBytes(0), seconds(0) {}
+
+		IOCounters& operator+=( const IOCounters& other )
+		{
+			rchar+=other.rchar; wchar+=other.wchar; syscr+=other.syscr; syscw+=other.syscw; readBytes+=other.readBytes; writeBytes+=other.writeBytes; seconds+=other.seconds;
+			return *this;
+		}
+		IOCounters& operator-=( const IOCounters& other )
+		{
+			rchar-=other.rchar; wchar-=other.wchar; syscr-=other.syscr; syscw-=other.syscw; readBytes-=other.readBytes; writeBytes-=other.writeBytes; seconds-=other.seconds;
+			return *this;
+		}
+	};
+
+	/** @brief Opens the io file for the calling thread. Returns -1 if the kernel doesn't provide one. */
+	int openThreadIOFile()
+	{
+		// /proc/thread-self only appeared in Linux 3.17, so fall back to the task directory
+		int fileDescriptor=open( "/proc/thread-self/io", O_RDONLY );
+		if( fileDescriptor<0 )
+		{
+			std::string filename="/proc/self/task/"+std::to_string( syscall(SYS_gettid) )+"/io";
+			fileDescriptor=open( filename.c_str(), O_RDONLY );
+		}
+		return fileDescriptor;
+	}
+
+	/// Every IOTracker gets a new number, so that threads don't use a file that an earlier one has closed
+	std::atomic<unsigned int> nextTrackerNumber( 0 );
+
+	/// Kept open until the IOTracker is destroyed and re-read from the start each time, which is much cheaper than opening it for every call.
+	/// -1 if it couldn't be opened.
+	thread_local int threadIOFile=-1;
+	/// Which IOTracker threadIOFile was opened for, zero if it hasn't been yet
+	thread_local unsigned int threadIOFileTracker=0;
+	/// What reading the io file has added to the counters so far on this thread, so that it can be taken off
+	thread_local ::IOCounters measurementOverhead;
+
+	double steadySeconds()
+	{
+		return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+	}
+
+	/** @brief Reads the I/O counters from the calling thread's io file, or leaves them all zero if they're not available. Doesn't set the time. */
+	::IOCounters readIOFile( int fileDescriptor )
+	{
+		::IOCounters counters;
+		if( fileDescriptor<0 ) return counters;
+
+		char buffer[512];
+		ssize_t bytesRead=pread( fileDescriptor, buffer, sizeof(buffer)-1, 0 );
+		if( bytesRead<=0 ) return counters;
+		buffer[bytesRead]='\0';
+
+		// The format is one "name: value" per line. See "man 5 proc".
+		char* pPosition=buffer;
+		while( *pPosition!='\0' )
+		{
+			char* pColon=std::strchr( pPosition, ':' );
+			if( pColon==nullptr ) break;
+			uint64_t value=std::strtoull( pColon+1, &pColon, 10 );
+			size_t nameLength=std::strcspn( pPosition, ":" );
+			if( std::strncmp(pPosition,"rchar",nameLength)==0 ) counters.rchar=value;
+			else if( std::strncmp(pPosition,"wchar",nameLength)==0 ) counters.wchar=value;
+			else if( std::strncmp(pPosition,"syscr",nameLength)==0 ) counters.syscr=value;
+			else if( std::strncmp(pPosition,"syscw",nameLength)==0 ) counters.syscw=value;
+			else if( std::strncmp(pPosition,"read_bytes",nameLength)==0 ) counters.readBytes=value;
+			else if( std::strncmp(pPosition,"write_bytes",nameLength)==0 ) counters.writeBytes=value;
+			pPosition=pColon;
+			while( *pPosition=='\n' ) ++pPosition;
+		}
+
+		// The kernel adds this read to the counters after the contents are generated, so it shows up in the next one
+		counters-=::measurementOverhead;
+		::measurementOverhead.rchar+=bytesRead;
+		::measurementOverhead.syscr+=1;
+		return counters;
+	}
+
+	thread_local markstools::services::NestedCallStack<::IOCounters> callStack;
+
+	struct ModuleIO
+	{
+		std::string moduleLabel;
+		std::string moduleName;
+		size_t calls;
+		::IOCounters io;
+		ModuleIO() : calls(0) {}
+
+		bool didIO() const { return io.syscr>0 || io.syscw>0 || io.readBytes>0 || io.writeBytes>0; }
+	};
+
+	double megabytesPerSecond( uint64_t bytes, double seconds )
+	{
+		return seconds>0 ? bytes/seconds/(1024*1024) : 0;
+	}
+
+	void printLine( std::ostream& output, const ::ModuleIO& moduleIO )
+	{
+		output << " *IOREPORT* " << moduleIO.moduleLabel << "," << moduleIO.moduleName << "," << moduleIO.calls << "," << moduleIO.io.seconds
+				<< "," << moduleIO.io.rchar << "," << moduleIO.io.wchar << "," << moduleIO.io.readBytes << "," << moduleIO.io.writeBytes
+				<< "," << moduleIO.io.syscr << "," << moduleIO.io.syscw
+				<< "," << ::megabytesPerSecond( moduleIO.io.rchar, moduleIO.io.seconds ) << "," << ::megabytesPerSecond( moduleIO.io.wchar, moduleIO.io.seconds ) << "\n";
+	}
+
+} // end of the unnamed namespace
+
+//
+// Define the pimple class
+//
+namespace markstools
+{
+	namespace services
+	{
+		class IOTrackerPimple
+		{
+		public:
+			void start();
+			/// @brief Returns false if the call started before tracking was set up. Otherwise io is what the call did, exclusive of nested calls.
+			bool end( ::IOCounters& io );
+			void add( ::ModuleIO& moduleIO, const ::IOCounters& io );
+			/// @brief Opens the thread's io file the first time the thread calls this, and reads it
+			::IOCounters readThreadIO();
+
+			unsigned int trackerNumber_;
+			std::mutex fileDescriptorMutex_; ///< Protects fileDescriptors_
+			std::vector<int> fileDescriptors_; ///< Every thread's io file, so that they can be closed at the end
+			std::mutex mutex_; ///< Protects moduleIO_ and sourceIO_
+			std::vector<::ModuleIO> moduleIO_; ///< Indexed by ModuleDescription::id(), entries with no calls are modules that never ran
+			::ModuleIO sourceIO_;
+		}; // end of the IOTrackerPimple class
+
+	} // end of the markstools::services namespace
+} // end of the markstools namespace
+
+markstools::services::IOTracker::IOTracker()
+	: pImple_( new IOTrackerPimple )
+{
+	pImple_->trackerNumber_=++::nextTrackerNumber;
+
+	int fileDescriptor=::openThreadIOFile();
+	if( fileDescriptor<0 ) std::cerr << " *** ModuleTimer: unable to open the per thread io file in /proc, so the I/O report will be empty." << std::endl;
+	else close( fileDescriptor );
+}
+
+markstools::services::IOTracker::~IOTracker()
+{
+	for( const auto fileDescriptor : pImple_->fileDescriptors_ ) close( fileDescriptor );
+	delete pImple_;
+}
+
+void markstools::services::IOTracker::preModule()
+{
+	pImple_->start();
+}
+
+void markstools::services::IOTracker::postModule( const edm::ModuleDescription& description )
+{
+	::IOCounters io;
+	if( !pImple_->end( io ) ) return;
+
+	std::lock_guard<std::mutex> lock( pImple_->mutex_ );
+	if( pImple_->moduleIO_.size()<=description.id() ) pImple_->moduleIO_.resize( description.id()+1 );
+	::ModuleIO& moduleIO=pImple_->moduleIO_[description.id()];
+	if( moduleIO.calls==0 )
+	{
+		moduleIO.moduleLabel=description.moduleLabel();
+		moduleIO.moduleName=description.moduleName();
+	}
+	pImple_->add( moduleIO, io );
+}
+
+void markstools::services::IOTracker::preSource()
+{
+	pImple_->start();
+}
+
+void markstools::services::IOTracker::postSource( const std::string& label )
+{
+	::IOCounters io;
+	if( !pImple_->end( io ) ) return;
+
+	std::lock_guard<std::mutex> lock( pImple_->mutex_ );
+	if( pImple_->sourceIO_.calls==0 )
+	{
+		pImple_->sourceIO_.moduleLabel=label;
+		pImple_->sourceIO_.moduleName="Source";
+	}
+	pImple_->add( pImple_->sourceIO_, io );
+}
+
+::IOCounters markstools::services::IOTrackerPimple::readThreadIO()
+{
+	if( ::threadIOFileTracker!=trackerNumber_ )
+	{
+		::threadIOFile=::openThreadIOFile();
+		::threadIOFileTracker=trackerNumber_;
+		if( ::threadIOFile>=0 )
+		{
+			std::lock_guard<std::mutex> lock( fileDescriptorMutex_ );
+			fileDescriptors_.push_back( ::threadIOFile );
+		}
+	}
+	return ::readIOFile( ::threadIOFile );
+}
+
+void markstools::services::IOTrackerPimple::start()
+{
+	// Read the counters last so that as little as possible of this gets counted
+	::IOCounters& startIO=::callStack.push();
+	double startSeconds=::steadySeconds();
+	startIO=readThreadIO();
+	startIO.seconds=startSeconds;
+}
+
+bool markstools::services::IOTrackerPimple::end( ::IOCounters& io )
+{
+	io=readThreadIO();
+	io.seconds=::steadySeconds();
+	return ::callStack.pop( io );
+}
+
+void markstools::services::IOTrackerPimple::add( ::ModuleIO& moduleIO, const ::IOCounters& io )
+{
+	++moduleIO.calls;
+	moduleIO.io+=io;
+}
+
+void markstools::services::IOTracker::print( std::ostream& output )
+{
+	std::lock_guard<std::mutex> lock( pImple_->mutex_ );
+
+	// Biggest consumers first, skipping the modules that didn't do any I/O at all
+	std::vector<const ::ModuleIO*> sortedModules;
+	::ModuleIO total;
+	total.moduleLabel="TOTAL";
+	auto addModule=[&sortedModules,&total]( const ::ModuleIO& moduleIO )
+		{
+			total.calls+=moduleIO.calls;
+			total.io+=moduleIO.io;
+			if( moduleIO.didIO() ) sortedModules.push_back( &moduleIO );
+		};
+	addModule( pImple_->sourceIO_ );
+	for( const auto& moduleIO : pImple_->moduleIO_ ) addModule( moduleIO );
+	std::sort( sortedModules.begin(), sortedModules.end(), []( const ::ModuleIO* pFirst, const ::ModuleIO* pSecond )
+			{ return pFirst->io.rchar+pFirst->io.wchar > pSecond->io.rchar+pSecond->io.wchar; } );
+
+	for( const auto pModuleIO : sortedModules ) ::printLine( output, *pModuleIO );
+	total.moduleName=std::to_string( sortedModules.size() ); // The number of modules that did any I/O in place of the type
+	::printLine( output, total );
+	output.flush();
+}
@@ -0,0 +1,58 @@
+#ifndef markstools_services_IOTracker_h
+#define markstools_services_IOTracker_h
+
+#include <iosfwd>
+#include <string>
+
+namespace edm
+{
+	class ModuleDescription;
+}
+
+namespace markstools
+{
+	namespace services
+	{
+		/** @brief Records the file and block I/O done by the calling thread during each module call, and by the source.
+		 *
+		 * Not a service in itself, ModuleTimer owns one of these if the "ioReport" parameter is set. The
+		 * counters in /proc/thread-self/io are read at the start and end of every call, so only I/O done
+		 * on the thread running the module is counted. Anything a module hands off to another thread (e.g.
+		 * ROOT's implicit multi-threading) will be missed.
+		 *
+		 * rchar and wchar are the bytes passed to read and write system calls, whether they hit the disk or
+		 * not. read_bytes is what had to come from storage. write_bytes is counted when page cache pages are
+		 * dirtied, so it's attributed to the right module even though the actual write happens later.
+		 *
+		 * If a module calls other modules (unscheduled) their I/O is subtracted from its own, so the
+		 * numbers for each module are exclusive.
+		 *
+		 * @author Mark Grimes (mark.grimes@bristol.ac.uk)
+		 * @date 19/Oct/2026
+		 */
+		class IOTracker
+		{
+		public:
+			IOTracker();
+			virtual ~IOTracker();
+
+			void preModule();
+			void postModule( const edm::ModuleDescription& description );
+			/// @brief The source isn't a module as far as the signals go, so it's recorded under the given label
+			void preSource();
+			void postSource( const std::string& label );
+
+			/// @brief Prints a " *IOREPORT* " line for each module that did any I/O, most bytes first, plus a summary line for the job
+			void print( std::ostream& output );
+
+			IOTracker( const IOTracker& otherIOTracker ) = delete;
+			IOTracker& operator=( const IOTracker& otherIOTracker ) = delete;
+		private:
+			/// @brief Hide all the private members in a pimple. Google "pimple idiom" for details.
+			class IOTrackerPimple* pImple_;
+		}; // end of class IOTracker
+
+	} // end of namespace services
+} // end of namespace markstools
+
+#endif // end of #ifndef markstools_services_IOTracker_h
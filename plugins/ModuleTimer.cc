@@ -1,11 +1,112 @@
 #include "ModuleTimer.h"
+#include "StartupProfile.h"
+#include "PlacementTracker.h"
+#include "IOTracker.h"
+#include "CpuSampler.h"
+#include "CacheTracker.h"
+#include "MarksTools/Benchmarking/interface/QuantileSketch.h"
+#include "MarksTools/Benchmarking/interface/TransitionName.h"
 #include "FWCore/ServiceRegistry/interface/ServiceMaker.h" // Required for DEFINE_FWK_SERVICE
 
 #include <DataFormats/Provenance/interface/ModuleDescription.h>
+#include "FWCore/ParameterSet/interface/ParameterSet.h"
+#include "FWCore/ServiceRegistry/interface/ActivityRegistry.h"
+
+// The signals in ActivityRegistry changed drastically to cover threaded
+// use, so I need to conditionally compile certain things depending on the
+// version of CMSSW. I can't find any macros about the CMSSW version, so
+// I'll just check one of the internal use ActivityRegistry macros. This
+// wasn't defined in the old ActivityRegistry file (pre 7_4_something).
+#ifdef AR_WATCH_USING_METHOD_3
+#	define MODULETIMER_USE_NEW_ACTIVITYREGISTRY_SIGNALS
+#	include "FWCore/ServiceRegistry/interface/ModuleCallingContext.h"
+#	include "FWCore/ServiceRegistry/interface/StreamContext.h"
+#	include "FWCore/ServiceRegistry/interface/SystemBounds.h"
+#	include "FWCore/ServiceRegistry/interface/GlobalContext.h"
+#endif
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <algorithm>
 #include <boost/chrono/process_cpu_clocks.hpp>
 
+//
+// Use the unnamed namespace for things only used in this file
+//
+namespace
+{
+	typedef std::chrono::steady_clock::time_point TimePoint;
+
+	double secondsBetween( TimePoint start, TimePoint end )
+	{
+		return std::chrono::duration<double>( end-start ).count();
+	}
+
+	struct StreamStatistics
+	{
+		size_t events;
+		TimePoint sourceStartTime; ///< When the event currently on this stream started being read
+		StreamStatistics() : events(0) {}
+	};
+
+	/** @brief What happened on one thread between modules. Only ever touched by that thread until the end of the job. */
+	struct ThreadStatistics
+	{
+		size_t moduleCalls;
+		double busyTime; ///< Total seconds spent inside modules
+		double gapTime; ///< Total seconds between one module finishing and the next starting
+		double maximumGap;
+		size_t gaps;
+		unsigned int depth; ///< Number of module calls currently running on this thread, since modules can call other modules (unscheduled)
+		TimePoint lastTransition; ///< Start of the outermost module call, or end of the last one if depth is zero
+		ThreadStatistics() : moduleCalls(0), busyTime(0), gapTime(0), maximumGap(0), gaps(0), depth(0) {}
+	};
+
+#ifdef MODULETIMER_USE_NEW_ACTIVITYREGISTRY_SIGNALS
+	/// Start times of the module calls running on this thread, innermost last, since modules can call other modules (unscheduled).
+	/// Note that process_cpu_clock is for the whole process, so when several threads are busy the CPU times include all of them.
+	thread_local std::vector<boost::chrono::process_cpu_clock::time_point> moduleStartTimes;
+
+	/** @brief The event currently being processed on one stream */
+	struct StreamEvent
+	{
+		size_t eventNumber;
+		boost::chrono::process_cpu_clock::time_point startTime;
+		StreamEvent() : eventNumber(0) {}
+	};
+#endif
+
+	/// Each thread's statistics, the ownership is kept by the ModuleTimerPimple so that they're still around at endJob.
+	thread_local ThreadStatistics* pThreadStatistics=nullptr;
+
+	/** @brief Distributions over events of the time taken by one module */
+	struct ModuleSketches
+	{
+		std::string moduleLabel;
+		std::string moduleName;
+		std::mutex mutex; ///< Only held while adding one value, so it's only contended if the module finishes on two streams at once
+		markstools::services::QuantileSketch realTime;
+		markstools::services::QuantileSketch cpuTime; ///< user plus system
+		ModuleSketches( const std::string& newModuleLabel, const std::string& newModuleName, double accuracy )
+			: moduleLabel(newModuleLabel), moduleName(newModuleName), realTime(accuracy), cpuTime(accuracy) {}
+	};
+
+	/// @brief Nearest rank percentile of an already sorted vector
+	double percentile( const std::vector<double>& sortedValues, double fraction )
+	{
+		if( sortedValues.empty() ) return 0;
+		size_t rank=static_cast<size_t>( fraction*sortedValues.size()+0.5 );
+		if( rank>0 ) --rank;
+		return sortedValues[ std::min(rank,sortedValues.size()-1) ];
+	}
+
+} // end of the unnamed namespace
 
 //
 // Define the pimple class
@@ -17,11 +118,67 @@ namespace markstools
 		class ModuleTimerPimple
 		{
 		public:
-			ModuleTimerPimple() : eventNumber_(1), verbose_(false) {}
-			size_t eventNumber_;
+			ModuleTimerPimple() : eventNumber_(1), verbose_(false), streamStatistics_(1), throughputBinWidth_(10), jobStarted_(false), sketchAccuracy_(0.01) {}
+			std::atomic<size_t> eventNumber_; ///< The current event, or with the threaded signals the number given to the next event to start on any stream
 			bool verbose_;
 			boost::chrono::process_cpu_clock::time_point moduleStartTime_;
 			boost::chrono::process_cpu_clock::time_point eventStartTime_;
+
+#ifdef MODULETIMER_USE_NEW_ACTIVITYREGISTRY_SIGNALS
+			//
+			// With the threaded signals modules run concurrently, so the times above can only be used for
+			// construction, beginJob and endJob (which run one module at a time) and these are used for the rest.
+			//
+			std::vector<::StreamEvent> streamEvents_; ///< Sized at preallocate; each entry is only used by the thread running that stream
+
+			void startModuleTimer();
+			/// @brief Prints the time since the matching startModuleTimer on this thread, and returns it
+			boost::chrono::process_cpu_clock::duration stopModuleTimer( const edm::ModuleDescription& description, const char* transitionName, const size_t* pTransitionNumber );
+			/// @brief Same as stopModuleTimer, labelled with the number of the event on the stream, and fills the sketches
+			void stopModuleTimerAfterEvent( unsigned int streamIndex, const edm::ModuleDescription& description );
+			void stopModuleTimerForCallingContext( edm::ModuleCallingContext const& mcc, const char* transitionName )
+			{
+				stopModuleTimer( *mcc.moduleDescription(), transitionName, nullptr );
+			}
+			void startEventTimer( unsigned int streamIndex );
+			void stopEventTimer( unsigned int streamIndex );
+#endif
+
+			//
+			// Everything below is only used if "throughputReport" is set
+			//
+			std::vector<::StreamStatistics> streamStatistics_; ///< Sized at preallocate; each entry is only used by the thread running that stream
+			double throughputBinWidth_; ///< Width in seconds of the bins of the throughput-over-time series
+			std::mutex mutex_; ///< Protects everything below
+			bool jobStarted_;
+			::TimePoint jobStartTime_; ///< When the first event started being read
+			::TimePoint lastEventEndTime_;
+			std::vector<double> eventLatencies_; ///< Seconds from the start of reading the event to the end of processing it
+			std::vector<size_t> eventsPerTimeBin_;
+			std::vector<std::unique_ptr<::ThreadStatistics> > threadStatistics_;
+
+			void sourceEventStart( unsigned int streamIndex );
+			void eventEnd( unsigned int streamIndex );
+			void moduleStart();
+			void moduleEnd();
+			void printThroughputReport();
+
+			std::unique_ptr<markstools::services::StartupProfile> pStartupProfile_; ///< Null unless "startupProfile" is set
+
+			std::string sketchFilename_; ///< Empty unless the distributions over events should be written at the end of the job
+			double sketchAccuracy_;
+			/// Indexed by ModuleDescription::id(). Filled in as the modules are constructed, so it doesn't change once events start and needs no lock.
+			std::vector<std::unique_ptr<::ModuleSketches> > moduleSketches_;
+			void createSketches( const edm::ModuleDescription& description );
+			void addToSketch( const edm::ModuleDescription& description, const boost::chrono::process_cpu_clock::duration& timeTaken );
+			void writeSketches();
+
+			std::unique_ptr<markstools::services::PlacementTracker> pPlacementTracker_; ///< Null unless "placementReport" is set
+			std::unique_ptr<markstools::services::IOTracker> pIOTracker_; ///< Null unless "ioReport" is set
+			std::unique_ptr<markstools::services::CacheTracker> pCacheTracker_; ///< Null unless "cacheReport" is set
+			std::unique_ptr<markstools::services::CpuSampler> pCpuSampler_; ///< Null unless "cpuProfileInterval" is set
+			std::string cpuProfileFilename_;
+			void writeCpuProfile();
 		}; // end of the PlottingTimerPimple class
 
 	} // end of the markstools::services namespace
@@ -33,12 +190,45 @@ markstools::services::ModuleTimer::ModuleTimer( const edm::ParameterSet& paramet
 	//
 	// Register all of the watching functions
 	//
+	ModuleTimerPimple* pImple=pImple_;
 	activityRegister.watchPreModuleConstruction( this, &ModuleTimer::preModuleConstruction );
 	activityRegister.watchPostModuleConstruction( this, &ModuleTimer::postModuleConstruction );
 
 	activityRegister.watchPreModuleBeginJob( this, &ModuleTimer::preModuleBeginJob );
 	activityRegister.watchPostModuleBeginJob( this, &ModuleTimer::postModuleBeginJob );
 
+#ifdef MODULETIMER_USE_NEW_ACTIVITYREGISTRY_SIGNALS
+	activityRegister.watchPreallocate( [pImple](edm::service::SystemBounds const& bounds){pImple->streamEvents_.resize(bounds.maxNumberOfStreams());} );
+	activityRegister.watchPreEvent( [pImple](edm::StreamContext const& context){pImple->startEventTimer(context.streamID().value());} );
+	activityRegister.watchPostEvent( [pImple](edm::StreamContext const& context){pImple->stopEventTimer(context.streamID().value());} );
+	activityRegister.watchPreModuleEvent( [pImple](edm::StreamContext const&, edm::ModuleCallingContext const&){pImple->startModuleTimer();} );
+	activityRegister.watchPostModuleEvent( [pImple](edm::StreamContext const& context, edm::ModuleCallingContext const& mcc){pImple->stopModuleTimerAfterEvent(context.streamID().value(),*mcc.moduleDescription());} );
+
+	// The stream transitions get the StreamContext and the global ones the GlobalContext, but only the ModuleCallingContext is needed
+	auto startStreamModule=[pImple](edm::StreamContext const&, edm::ModuleCallingContext const&){pImple->startModuleTimer();};
+	auto startGlobalModule=[pImple](edm::GlobalContext const&, edm::ModuleCallingContext const&){pImple->startModuleTimer();};
+	activityRegister.watchPreModuleBeginStream( startStreamModule );
+	activityRegister.watchPostModuleBeginStream( std::bind( &ModuleTimerPimple::stopModuleTimerForCallingContext, pImple_, std::placeholders::_2, "beginStream" ) );
+	activityRegister.watchPreModuleStreamBeginRun( startStreamModule );
+	activityRegister.watchPostModuleStreamBeginRun( std::bind( &ModuleTimerPimple::stopModuleTimerForCallingContext, pImple_, std::placeholders::_2, "streamBeginRun" ) );
+	activityRegister.watchPreModuleStreamBeginLumi( startStreamModule );
+	activityRegister.watchPostModuleStreamBeginLumi( std::bind( &ModuleTimerPimple::stopModuleTimerForCallingContext, pImple_, std::placeholders::_2, "streamBeginLumi" ) );
+	activityRegister.watchPreModuleStreamEndLumi( startStreamModule );
+	activityRegister.watchPostModuleStreamEndLumi( std::bind( &ModuleTimerPimple::stopModuleTimerForCallingContext, pImple_, std::placeholders::_2, "streamEndLumi" ) );
+	activityRegister.watchPreModuleStreamEndRun( startStreamModule );
+	activityRegister.watchPostModuleStreamEndRun( std::bind( &ModuleTimerPimple::stopModuleTimerForCallingContext, pImple_, std::placeholders::_2, "streamEndRun" ) );
+	activityRegister.watchPreModuleEndStream( startStreamModule );
+	activityRegister.watchPostModuleEndStream( std::bind( &ModuleTimerPimple::stopModuleTimerForCallingContext, pImple_, std::placeholders::_2, "endStream" ) );
+
+	activityRegister.watchPreModuleGlobalBeginRun( startGlobalModule );
+	activityRegister.watchPostModuleGlobalBeginRun( std::bind( &ModuleTimerPimple::stopModuleTimerForCallingContext, pImple_, std::placeholders::_2, "beginRun" ) );
+	activityRegister.watchPreModuleGlobalBeginLumi( startGlobalModule );
+	activityRegister.watchPostModuleGlobalBeginLumi( std::bind( &ModuleTimerPimple::stopModuleTimerForCallingContext, pImple_, std::placeholders::_2, "beginLumi" ) );
+	activityRegister.watchPreModuleGlobalEndLumi( startGlobalModule );
+	activityRegister.watchPostModuleGlobalEndLumi( std::bind( &ModuleTimerPimple::stopModuleTimerForCallingContext, pImple_, std::placeholders::_2, "endLumi" ) );
+	activityRegister.watchPreModuleGlobalEndRun( startGlobalModule );
+	activityRegister.watchPostModuleGlobalEndRun( std::bind( &ModuleTimerPimple::stopModuleTimerForCallingContext, pImple_, std::placeholders::_2, "endRun" ) );
+#else
 	activityRegister.watchPreModuleBeginRun( this, &ModuleTimer::preModuleBeginRun );
 	activityRegister.watchPostModuleBeginRun( this, &ModuleTimer::postModuleBeginRun );
 
@@ -56,9 +246,174 @@ markstools::services::ModuleTimer::ModuleTimer( const edm::ParameterSet& paramet
 
 	activityRegister.watchPreModuleEndRun( this, &ModuleTimer::preModuleEndRun );
 	activityRegister.watchPostModuleEndRun( this, &ModuleTimer::postModuleEndRun );
+#endif
 
 	activityRegister.watchPreModuleEndJob( this, &ModuleTimer::preModuleEndJob );
 	activityRegister.watchPostModuleEndJob( this, &ModuleTimer::postModuleEndJob );
+
+	//
+	// Optional job level report on how well the threads and streams are being used
+	//
+	if( parameterSet.exists("throughputReport") && parameterSet.getParameter<bool>("throughputReport") )
+	{
+		if( parameterSet.exists("throughputBinWidth") ) pImple_->throughputBinWidth_=parameterSet.getParameter<double>("throughputBinWidth");
+
+#ifdef MODULETIMER_USE_NEW_ACTIVITYREGISTRY_SIGNALS
+		activityRegister.watchPreallocate( [pImple](edm::service::SystemBounds const& bounds){pImple->streamStatistics_.resize(bounds.maxNumberOfStreams());} );
+		activityRegister.watchPreSourceEvent( [pImple](edm::StreamID streamID){pImple->sourceEventStart(streamID.value());} );
+		activityRegister.watchPostEvent( [pImple](edm::StreamContext const& context){pImple->eventEnd(context.streamID().value());} );
+		activityRegister.watchPreModuleEvent( [pImple](edm::StreamContext const&, edm::ModuleCallingContext const&){pImple->moduleStart();} );
+		activityRegister.watchPostModuleEvent( [pImple](edm::StreamContext const&, edm::ModuleCallingContext const&){pImple->moduleEnd();} );
+#else
+		activityRegister.watchPreSource( [pImple]{pImple->sourceEventStart(0);} );
+		activityRegister.watchPostProcessEvent( [pImple](const edm::Event&,const edm::EventSetup&){pImple->eventEnd(0);} );
+		activityRegister.watchPreModule( [pImple](const edm::ModuleDescription&){pImple->moduleStart();} );
+		activityRegister.watchPostModule( [pImple](const edm::ModuleDescription&){pImple->moduleEnd();} );
+#endif
+		activityRegister.watchPostEndJob( std::bind( &ModuleTimerPimple::printThroughputReport, pImple_ ) );
+	}
+
+	//
+	// Optional timeline of the job startup, including the shared libraries loaded for each module
+	//
+	if( parameterSet.exists("startupProfile") && parameterSet.getParameter<bool>("startupProfile") )
+	{
+		pImple_->pStartupProfile_.reset( new StartupProfile );
+		StartupProfile* pStartupProfile=pImple_->pStartupProfile_.get();
+		activityRegister.watchPreSourceConstruction( std::bind( &StartupProfile::preModuleConstruction, pStartupProfile, std::placeholders::_1 ) );
+		activityRegister.watchPostSourceConstruction( std::bind( &StartupProfile::postModuleConstruction, pStartupProfile, std::placeholders::_1 ) );
+		activityRegister.watchPreModuleConstruction( std::bind( &StartupProfile::preModuleConstruction, pStartupProfile, std::placeholders::_1 ) );
+		activityRegister.watchPostModuleConstruction( std::bind( &StartupProfile::postModuleConstruction, pStartupProfile, std::placeholders::_1 ) );
+		activityRegister.watchPreModuleBeginJob( std::bind( &StartupProfile::preModuleBeginJob, pStartupProfile, std::placeholders::_1 ) );
+		activityRegister.watchPostModuleBeginJob( std::bind( &StartupProfile::postModuleBeginJob, pStartupProfile, std::placeholders::_1 ) );
+		activityRegister.watchPostBeginJob( [pStartupProfile]{pStartupProfile->print(std::cout);} );
+	}
+
+	//
+	// Optional fixed size summary of the per event times, which can be merged over many jobs with mergeBenchmarkSketches
+	//
+	if( parameterSet.exists("sketchFilename") )
+	{
+		pImple_->sketchFilename_=parameterSet.getParameter<std::string>("sketchFilename");
+		if( parameterSet.exists("sketchAccuracy") ) pImple_->sketchAccuracy_=parameterSet.getParameter<double>("sketchAccuracy");
+		activityRegister.watchPreModuleConstruction( std::bind( &ModuleTimerPimple::createSketches, pImple_, std::placeholders::_1 ) );
+		activityRegister.watchPostEndJob( std::bind( &ModuleTimerPimple::writeSketches, pImple_ ) );
+	}
+
+	//
+	// Optional record of which CPU and NUMA node each module ran on
+	//
+	if( parameterSet.exists("placementReport") && parameterSet.getParameter<bool>("placementReport") )
+	{
+		pImple_->pPlacementTracker_.reset( new PlacementTracker );
+		PlacementTracker* pPlacementTracker=pImple_->pPlacementTracker_.get();
+#ifdef MODULETIMER_USE_NEW_ACTIVITYREGISTRY_SIGNALS
+		activityRegister.watchPreallocate( [pPlacementTracker](edm::service::SystemBounds const& bounds){pPlacementTracker->setNumberOfStreams(bounds.maxNumberOfStreams());} );
+		activityRegister.watchPreSourceEvent( [pPlacementTracker](edm::StreamID streamID){pPlacementTracker->sourceEventStart(streamID.value());} );
+		activityRegister.watchPreModuleEvent( [pPlacementTracker](edm::StreamContext const& context, edm::ModuleCallingContext const&){pPlacementTracker->preModule(context.streamID().value());} );
+		activityRegister.watchPostModuleEvent( [pPlacementTracker](edm::StreamContext const&, edm::ModuleCallingContext const& mcc){pPlacementTracker->postModule(*mcc.moduleDescription());} );
+#else
+		activityRegister.watchPreSource( [pPlacementTracker]{pPlacementTracker->sourceEventStart(0);} );
+		activityRegister.watchPreModule( [pPlacementTracker](const edm::ModuleDescription&){pPlacementTracker->preModule(0);} );
+		activityRegister.watchPostModule( std::bind( &PlacementTracker::postModule, pPlacementTracker, std::placeholders::_1 ) );
+#endif
+		activityRegister.watchPostEndJob( [pPlacementTracker]{pPlacementTracker->print(std::cout);} );
+	}
+
+	//
+	// Optional per module file and block I/O, read from /proc/thread-self/io around each call
+	//
+	if( parameterSet.exists("ioReport") && parameterSet.getParameter<bool>("ioReport") )
+	{
+		pImple_->pIOTracker_.reset( new IOTracker );
+		IOTracker* pIOTracker=pImple_->pIOTracker_.get();
+#ifdef MODULETIMER_USE_NEW_ACTIVITYREGISTRY_SIGNALS
+		activityRegister.watchPreSourceEvent( [pIOTracker](edm::StreamID){pIOTracker->preSource();} );
+		activityRegister.watchPostSourceEvent( [pIOTracker](edm::StreamID){pIOTracker->postSource("source");} );
+		activityRegister.watchPreModuleEvent( [pIOTracker](edm::StreamContext const&, edm::ModuleCallingContext const&){pIOTracker->preModule();} );
+		activityRegister.watchPostModuleEvent( [pIOTracker](edm::StreamContext const&, edm::ModuleCallingContext const& mcc){pIOTracker->postModule(*mcc.moduleDescription());} );
+#else
+		activityRegister.watchPreSource( [pIOTracker]{pIOTracker->preSource();} );
+		activityRegister.watchPostSource( [pIOTracker]{pIOTracker->postSource("source");} );
+		activityRegister.watchPreModule( [pIOTracker](const edm::ModuleDescription&){pIOTracker->preModule();} );
+		activityRegister.watchPostModule( std::bind( &IOTracker::postModule, pIOTracker, std::placeholders::_1 ) );
+#endif
+		activityRegister.watchPostEndJob( [pIOTracker]{pIOTracker->print(std::cout);} );
+	}
+
+	//
+	// Optional per module cache misses from the hardware counters, and how much each module is slowed down by the one before it
+	//
+	if( parameterSet.exists("cacheReport") && parameterSet.getParameter<bool>("cacheReport") )
+	{
+		size_t pairsToReport=20;
+		if( parameterSet.exists("cacheReportPairs") ) pairsToReport=parameterSet.getParameter<unsigned int>("cacheReportPairs");
+		pImple_->pCacheTracker_.reset( new CacheTracker( pairsToReport ) );
+		CacheTracker* pCacheTracker=pImple_->pCacheTracker_.get();
+#ifdef MODULETIMER_USE_NEW_ACTIVITYREGISTRY_SIGNALS
+		activityRegister.watchPreModuleEvent( [pCacheTracker](edm::StreamContext const&, edm::ModuleCallingContext const&){pCacheTracker->preModule();} );
+		activityRegister.watchPostModuleEvent( [pCacheTracker](edm::StreamContext const&, edm::ModuleCallingContext const& mcc){pCacheTracker->postModule(*mcc.moduleDescription());} );
+#else
+		activityRegister.watchPreModule( [pCacheTracker](const edm::ModuleDescription&){pCacheTracker->preModule();} );
+		activityRegister.watchPostModule( std::bind( &CacheTracker::postModule, pCacheTracker, std::placeholders::_1 ) );
+#endif
+		activityRegister.watchPostEndJob( [pCacheTracker]{pCacheTracker->print(std::cout);} );
+	}
+
+	//
+	// Optional sampling CPU profile of the selected modules, with the stacks written out for flamegraph.pl
+	//
+	if( parameterSet.exists("cpuProfileInterval") && parameterSet.getParameter<unsigned int>("cpuProfileInterval")>0 )
+	{
+		std::vector<std::string> modulesToProfile;
+		if( parameterSet.exists("cpuProfileModules") ) modulesToProfile=parameterSet.getParameter< std::vector<std::string> >("cpuProfileModules");
+		pImple_->cpuProfileFilename_="cpuProfile.folded";
+		if( parameterSet.exists("cpuProfileFilename") ) pImple_->cpuProfileFilename_=parameterSet.getParameter<std::string>("cpuProfileFilename");
+		pImple_->pCpuSampler_.reset( new CpuSampler( parameterSet.getParameter<unsigned int>("cpuProfileInterval"), modulesToProfile ) );
+
+		CpuSampler* pCpuSampler=pImple_->pCpuSampler_.get();
+		typedef CpuSampler::Transition Transition;
+		activityRegister.watchPreModuleConstruction( std::bind( &CpuSampler::selectModule, pCpuSampler, std::placeholders::_1 ) );
+		activityRegister.watchPreModuleBeginJob( std::bind( &CpuSampler::preModule, pCpuSampler, std::placeholders::_1, Transition::BeginJob ) );
+		activityRegister.watchPostModuleBeginJob( std::bind( &CpuSampler::postModule, pCpuSampler, std::placeholders::_1 ) );
+#ifdef MODULETIMER_USE_NEW_ACTIVITYREGISTRY_SIGNALS
+		// The stream and global versions of each transition are recorded together
+		auto postStreamModule=[pCpuSampler](edm::StreamContext const&, edm::ModuleCallingContext const& mcc){pCpuSampler->postModule(*mcc.moduleDescription());};
+		auto postGlobalModule=[pCpuSampler](edm::GlobalContext const&, edm::ModuleCallingContext const& mcc){pCpuSampler->postModule(*mcc.moduleDescription());};
+		activityRegister.watchPreModuleStreamBeginRun( [pCpuSampler](edm::StreamContext const&, edm::ModuleCallingContext const& mcc){pCpuSampler->preModule(*mcc.moduleDescription(),Transition::BeginRun);} );
+		activityRegister.watchPostModuleStreamBeginRun( postStreamModule );
+		activityRegister.watchPreModuleGlobalBeginRun( [pCpuSampler](edm::GlobalContext const&, edm::ModuleCallingContext const& mcc){pCpuSampler->preModule(*mcc.moduleDescription(),Transition::BeginRun);} );
+		activityRegister.watchPostModuleGlobalBeginRun( postGlobalModule );
+		activityRegister.watchPreModuleStreamBeginLumi( [pCpuSampler](edm::StreamContext const&, edm::ModuleCallingContext const& mcc){pCpuSampler->preModule(*mcc.moduleDescription(),Transition::BeginLumi);} );
+		activityRegister.watchPostModuleStreamBeginLumi( postStreamModule );
+		activityRegister.watchPreModuleGlobalBeginLumi( [pCpuSampler](edm::GlobalContext const&, edm::ModuleCallingContext const& mcc){pCpuSampler->preModule(*mcc.moduleDescription(),Transition::BeginLumi);} );
+		activityRegister.watchPostModuleGlobalBeginLumi( postGlobalModule );
+		activityRegister.watchPreModuleEvent( [pCpuSampler](edm::StreamContext const&, edm::ModuleCallingContext const& mcc){pCpuSampler->preModule(*mcc.moduleDescription(),Transition::Event);} );
+		activityRegister.watchPostModuleEvent( postStreamModule );
+		activityRegister.watchPreModuleStreamEndLumi( [pCpuSampler](edm::StreamContext const&, edm::ModuleCallingContext const& mcc){pCpuSampler->preModule(*mcc.moduleDescription(),Transition::EndLumi);} );
+		activityRegister.watchPostModuleStreamEndLumi( postStreamModule );
+		activityRegister.watchPreModuleGlobalEndLumi( [pCpuSampler](edm::GlobalContext const&, edm::ModuleCallingContext const& mcc){pCpuSampler->preModule(*mcc.moduleDescription(),Transition::EndLumi);} );
+		activityRegister.watchPostModuleGlobalEndLumi( postGlobalModule );
+		activityRegister.watchPreModuleStreamEndRun( [pCpuSampler](edm::StreamContext const&, edm::ModuleCallingContext const& mcc){pCpuSampler->preModule(*mcc.moduleDescription(),Transition::EndRun);} );
+		activityRegister.watchPostModuleStreamEndRun( postStreamModule );
+		activityRegister.watchPreModuleGlobalEndRun( [pCpuSampler](edm::GlobalContext const&, edm::ModuleCallingContext const& mcc){pCpuSampler->preModule(*mcc.moduleDescription(),Transition::EndRun);} );
+		activityRegister.watchPostModuleGlobalEndRun( postGlobalModule );
+#else
+		activityRegister.watchPreModuleBeginRun( std::bind( &CpuSampler::preModule, pCpuSampler, std::placeholders::_1, Transition::BeginRun ) );
+		activityRegister.watchPostModuleBeginRun( std::bind( &CpuSampler::postModule, pCpuSampler, std::placeholders::_1 ) );
+		activityRegister.watchPreModuleBeginLumi( std::bind( &CpuSampler::preModule, pCpuSampler, std::placeholders::_1, Transition::BeginLumi ) );
+		activityRegister.watchPostModuleBeginLumi( std::bind( &CpuSampler::postModule, pCpuSampler, std::placeholders::_1 ) );
+		activityRegister.watchPreModule( std::bind( &CpuSampler::preModule, pCpuSampler, std::placeholders::_1, Transition::Event ) );
+		activityRegister.watchPostModule( std::bind( &CpuSampler::postModule, pCpuSampler, std::placeholders::_1 ) );
+		activityRegister.watchPreModuleEndLumi( std::bind( &CpuSampler::preModule, pCpuSampler, std::placeholders::_1, Transition::EndLumi ) );
+		activityRegister.watchPostModuleEndLumi( std::bind( &CpuSampler::postModule, pCpuSampler, std::placeholders::_1 ) );
+		activityRegister.watchPreModuleEndRun( std::bind( &CpuSampler::preModule, pCpuSampler, std::placeholders::_1, Transition::EndRun ) );
+		activityRegister.watchPostModuleEndRun( std::bind( &CpuSampler::postModule, pCpuSampler, std::placeholders::_1 ) );
+#endif
+		activityRegister.watchPreModuleEndJob( std::bind( &CpuSampler::preModule, pCpuSampler, std::placeholders::_1, Transition::EndJob ) );
+		activityRegister.watchPostModuleEndJob( std::bind( &CpuSampler::postModule, pCpuSampler, std::placeholders::_1 ) );
+		activityRegister.watchPostEndJob( std::bind( &ModuleTimerPimple::writeCpuProfile, pImple_ ) );
+	}
 }
 
 markstools::services::ModuleTimer::~ModuleTimer()
@@ -124,6 +479,7 @@ void markstools::services::ModuleTimer::postModule( const edm::ModuleDescription
 	boost::chrono::process_cpu_clock::duration timeTaken( boost::chrono::process_cpu_clock::now()-pImple_->moduleStartTime_ );
 	std::cout << " *MODULETIMER* event" << pImple_->eventNumber_ << "," << description.moduleLabel() << "," << description.moduleName()
 			<< "," << timeTaken.count().real << "," << timeTaken.count().user << "," << timeTaken.count().system << std::endl;
+	if( !pImple_->sketchFilename_.empty() ) pImple_->addToSketch( description, timeTaken );
 }
 
 void markstools::services::ModuleTimer::preProcessEvent( const edm::EventID& eventID, const edm::Timestamp& timeStamp )
@@ -174,3 +530,206 @@ void markstools::services::ModuleTimer::postModuleEndJob( const edm::ModuleDescr
 	std::cout << " *MODULETIMER* endJob," << description.moduleLabel() << "," << description.moduleName()
 			<< "," << timeTaken.count().real << "," << timeTaken.count().user << "," << timeTaken.count().system << std::endl;
 }
+
+#ifdef MODULETIMER_USE_NEW_ACTIVITYREGISTRY_SIGNALS
+void markstools::services::ModuleTimerPimple::startModuleTimer()
+{
+	::moduleStartTimes.push_back( boost::chrono::process_cpu_clock::now() );
+}
+
+boost::chrono::process_cpu_clock::duration markstools::services::ModuleTimerPimple::stopModuleTimer( const edm::ModuleDescription& description, const char* transitionName, const size_t* pTransitionNumber )
+{
+	boost::chrono::process_cpu_clock::time_point now=boost::chrono::process_cpu_clock::now();
+	if( ::moduleStartTimes.empty() ) return boost::chrono::process_cpu_clock::duration(); // Started before the service was set up
+	boost::chrono::process_cpu_clock::duration timeTaken( now-::moduleStartTimes.back() );
+	::moduleStartTimes.pop_back();
+
+	// Format the whole line first so that lines from different threads don't get mixed together
+	std::ostringstream line;
+	line << " *MODULETIMER* " << TransitionName(transitionName,pTransitionNumber) << "," << description.moduleLabel() << "," << description.moduleName()
+			<< "," << timeTaken.count().real << "," << timeTaken.count().user << "," << timeTaken.count().system << "\n";
+	std::cout << line.str() << std::flush;
+	return timeTaken;
+}
+
+void markstools::services::ModuleTimerPimple::stopModuleTimerAfterEvent( unsigned int streamIndex, const edm::ModuleDescription& description )
+{
+	boost::chrono::process_cpu_clock::duration timeTaken=stopModuleTimer( description, "event", &streamEvents_[streamIndex].eventNumber );
+	if( !sketchFilename_.empty() ) addToSketch( description, timeTaken );
+}
+
+void markstools::services::ModuleTimerPimple::startEventTimer( unsigned int streamIndex )
+{
+	::StreamEvent& streamEvent=streamEvents_[streamIndex];
+	streamEvent.eventNumber=eventNumber_++;
+	streamEvent.startTime=boost::chrono::process_cpu_clock::now();
+}
+
+void markstools::services::ModuleTimerPimple::stopEventTimer( unsigned int streamIndex )
+{
+	const ::StreamEvent& streamEvent=streamEvents_[streamIndex];
+	boost::chrono::process_cpu_clock::duration timeTaken( boost::chrono::process_cpu_clock::now()-streamEvent.startTime );
+	std::ostringstream line;
+	line << " *MODULETIMER* event" << streamEvent.eventNumber << ",EVENT,EVENT"
+			<< "," << timeTaken.count().real << "," << timeTaken.count().user << "," << timeTaken.count().system << "\n";
+	std::cout << line.str() << std::flush;
+}
+#endif
+
+void markstools::services::ModuleTimerPimple::sourceEventStart( unsigned int streamIndex )
+{
+	::TimePoint now=std::chrono::steady_clock::now();
+	streamStatistics_[streamIndex].sourceStartTime=now;
+
+	std::lock_guard<std::mutex> lock( mutex_ );
+	if( !jobStarted_ )
+	{
+		jobStarted_=true;
+		jobStartTime_=now;
+	}
+}
+
+void markstools::services::ModuleTimerPimple::eventEnd( unsigned int streamIndex )
+{
+	::TimePoint now=std::chrono::steady_clock::now();
+	::StreamStatistics& stream=streamStatistics_[streamIndex];
+	++stream.events;
+
+	std::lock_guard<std::mutex> lock( mutex_ );
+	eventLatencies_.push_back( ::secondsBetween(stream.sourceStartTime,now) );
+	lastEventEndTime_=now;
+
+	size_t bin=static_cast<size_t>( ::secondsBetween(jobStartTime_,now)/throughputBinWidth_ );
+	if( eventsPerTimeBin_.size()<=bin ) eventsPerTimeBin_.resize( bin+1, 0 );
+	++eventsPerTimeBin_[bin];
+}
+
+void markstools::services::ModuleTimerPimple::moduleStart()
+{
+	::TimePoint now=std::chrono::steady_clock::now();
+	if( ::pThreadStatistics==nullptr )
+	{
+		std::lock_guard<std::mutex> lock( mutex_ );
+		threadStatistics_.emplace_back( new ::ThreadStatistics );
+		::pThreadStatistics=threadStatistics_.back().get();
+	}
+	::ThreadStatistics& thread=*::pThreadStatistics;
+
+	// Only the outermost call on the thread can follow a gap, and only if the thread has run a module before
+	if( thread.depth==0 )
+	{
+		if( thread.moduleCalls>0 )
+		{
+			double gap=::secondsBetween( thread.lastTransition, now );
+			thread.gapTime+=gap;
+			thread.maximumGap=std::max( thread.maximumGap, gap );
+			++thread.gaps;
+		}
+		thread.lastTransition=now;
+	}
+	++thread.depth;
+	++thread.moduleCalls;
+}
+
+void markstools::services::ModuleTimerPimple::moduleEnd()
+{
+	if( ::pThreadStatistics==nullptr ) return;
+	::ThreadStatistics& thread=*::pThreadStatistics;
+	if( thread.depth==0 ) return; // Started before the thread was registered
+	if( --thread.depth>0 ) return; // Nested call, the time is counted when the outermost one finishes
+
+	::TimePoint now=std::chrono::steady_clock::now();
+	thread.busyTime+=::secondsBetween( thread.lastTransition, now );
+	thread.lastTransition=now;
+}
+
+void markstools::services::ModuleTimerPimple::printThroughputReport()
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+	double wallTime=( jobStarted_ ? ::secondsBetween(jobStartTime_,lastEventEndTime_) : 0 );
+	double eventRateScale=( wallTime>0 ? 1.0/wallTime : 0 );
+
+	for( size_t streamIndex=0; streamIndex<streamStatistics_.size(); ++streamIndex )
+	{
+		std::cout << " *THROUGHPUT* stream," << streamIndex << "," << streamStatistics_[streamIndex].events
+				<< "," << streamStatistics_[streamIndex].events*eventRateScale << std::endl;
+	}
+	std::cout << " *THROUGHPUT* overall," << streamStatistics_.size() << "," << eventLatencies_.size()
+			<< "," << eventLatencies_.size()*eventRateScale << "," << wallTime << std::endl;
+
+	std::sort( eventLatencies_.begin(), eventLatencies_.end() );
+	std::cout << " *THROUGHPUT* latency," << ::percentile(eventLatencies_,0.5) << "," << ::percentile(eventLatencies_,0.9)
+			<< "," << ::percentile(eventLatencies_,0.95) << "," << ::percentile(eventLatencies_,0.99)
+			<< "," << ( eventLatencies_.empty() ? 0 : eventLatencies_.back() ) << std::endl;
+
+	for( size_t threadIndex=0; threadIndex<threadStatistics_.size(); ++threadIndex )
+	{
+		const ::ThreadStatistics& thread=*threadStatistics_[threadIndex];
+		std::cout << " *THROUGHPUT* thread," << threadIndex << "," << thread.moduleCalls << "," << thread.busyTime << "," << thread.gapTime
+				<< "," << ( thread.gaps>0 ? thread.gapTime/thread.gaps*1e6 : 0 ) << "," << thread.maximumGap*1e6 << std::endl;
+	}
+
+	for( size_t bin=0; bin<eventsPerTimeBin_.size(); ++bin )
+	{
+		std::cout << " *THROUGHPUT* series," << bin*throughputBinWidth_ << "," << eventsPerTimeBin_[bin]
+				<< "," << eventsPerTimeBin_[bin]/throughputBinWidth_ << std::endl;
+	}
+}
+
+void markstools::services::ModuleTimerPimple::createSketches( const edm::ModuleDescription& description )
+{
+	if( moduleSketches_.size()<=description.id() ) moduleSketches_.resize( description.id()+1 );
+	moduleSketches_[description.id()].reset( new ::ModuleSketches( description.moduleLabel(), description.moduleName(), sketchAccuracy_ ) );
+}
+
+void markstools::services::ModuleTimerPimple::addToSketch( const edm::ModuleDescription& description, const boost::chrono::process_cpu_clock::duration& timeTaken )
+{
+	if( description.id()>=moduleSketches_.size() || !moduleSketches_[description.id()] ) return; // Wasn't constructed through the framework
+	::ModuleSketches& sketches=*moduleSketches_[description.id()];
+
+	// process_cpu_clock counts in nanoseconds, but seconds are easier to read in the merged output
+	std::lock_guard<std::mutex> lock( sketches.mutex );
+	sketches.realTime.add( timeTaken.count().real*1e-9 );
+	sketches.cpuTime.add( (timeTaken.count().user+timeTaken.count().system)*1e-9 );
+}
+
+void markstools::services::ModuleTimerPimple::writeSketches()
+{
+	std::ofstream outputFile( sketchFilename_ );
+	if( !outputFile.is_open() )
+	{
+		std::cerr << " *** ModuleTimer: unable to open \"" << sketchFilename_ << "\" to write the sketches" << std::endl;
+		return;
+	}
+
+	// Only the modules that had event calls, in label order as before
+	std::vector<const ::ModuleSketches*> sortedSketches;
+	for( const auto& pSketches : moduleSketches_ )
+	{
+		if( pSketches && pSketches->realTime.count()>0 ) sortedSketches.push_back( pSketches.get() );
+	}
+	std::sort( sortedSketches.begin(), sortedSketches.end(), []( const ::ModuleSketches* pFirst, const ::ModuleSketches* pSecond ){ return pFirst->moduleLabel<pSecond->moduleLabel; } );
+
+	outputFile << "# moduleLabel moduleType metric sketch" << "\n";
+	for( const auto pSketches : sortedSketches )
+	{
+		outputFile << pSketches->moduleLabel << " " << pSketches->moduleName << " real ";
+		pSketches->realTime.write( outputFile );
+		outputFile << "\n" << pSketches->moduleLabel << " " << pSketches->moduleName << " cpu ";
+		pSketches->cpuTime.write( outputFile );
+		outputFile << "\n";
+	}
+}
+
+void markstools::services::ModuleTimerPimple::writeCpuProfile()
+{
+	pCpuSampler_->printSummary( std::cout );
+
+	std::ofstream outputFile( cpuProfileFilename_ );
+	if( !outputFile.is_open() )
+	{
+		std::cerr << " *** ModuleTimer: unable to open \"" << cpuProfileFilename_ << "\" to write the CPU profile" << std::endl;
+		return;
+	}
+	pCpuSampler_->writeFoldedStacks( outputFile );
+}
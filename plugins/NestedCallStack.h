@@ -0,0 +1,64 @@
+#ifndef markstools_services_NestedCallStack_h
+#define markstools_services_NestedCallStack_h
+
+#include <vector>
+
+namespace markstools
+{
+	namespace services
+	{
+		/** @brief The module calls currently running on one thread, so that each call's measurement can be made exclusive of the calls nested in it.
+		 *
+		 * Modules can call other modules (unscheduled), so the trackers keep one of these per thread (as a
+		 * thread_local). Counters is whatever is measured at the start and end of a call, e.g. a time or a set
+		 * of I/O counters, and needs a default constructor that gives zero plus += and -=. StartInfo is anything
+		 * else the tracker wants to remember about the call until it ends.
+		 *
+		 * @author Mark Grimes (mark.grimes@bristol.ac.uk)
+		 * @date 19/Oct/2026
+		 */
+		template<class Counters,class StartInfo=bool>
+		class NestedCallStack
+		{
+		public:
+			/** @brief Starts a call, and returns its start counters to be filled in.
+			 *
+			 * The reference is so that the counters can be read as the very last thing, so that as little as
+			 * possible of the bookkeeping gets counted. It's only valid until the next push. */
+			Counters& push( const StartInfo& startInfo=StartInfo() )
+			{
+				calls_.push_back( Call{ Counters(), Counters(), startInfo } );
+				return calls_.back().start;
+			}
+
+			/** @brief Ends the innermost call. On entry counters is what was read at the end of the call, on return it's what the call used itself.
+			 *
+			 * Returns false if there's no call to end, i.e. it started before tracking was set up, in which case
+			 * nothing is changed. The call's total is added to the nested total of the call it was made from. */
+			bool pop( Counters& counters, StartInfo* pStartInfo=nullptr )
+			{
+				if( calls_.empty() ) return false;
+				const Call& call=calls_.back();
+				counters-=call.start;
+				if( calls_.size()>1 ) calls_[calls_.size()-2].nested+=counters;
+				counters-=call.nested;
+				if( pStartInfo!=nullptr ) *pStartInfo=call.startInfo;
+				calls_.pop_back();
+				return true;
+			}
+
+			bool empty() const { return calls_.empty(); }
+		private:
+			struct Call
+			{
+				Counters start;
+				Counters nested; ///< The total of the calls made from this one
+				StartInfo startInfo;
+			};
+			std::vector<Call> calls_;
+		}; // end of class NestedCallStack
+
+	} // end of namespace services
+} // end of namespace markstools
+
+#endif // end of #ifndef markstools_services_NestedCallStack_h
@@ -0,0 +1,192 @@
+#include "PlacementTracker.h"
+#include "NestedCallStack.h"
+
+#include <sched.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <DataFormats/Provenance/interface/ModuleDescription.h>
+
+//
+// Use the unnamed namespace for things only used in this file.
+//
+namespace
+{
+	/// Nodes aren't always numbered contiguously, so look this far for them
+	const int maximumNumaNodes=64;
+
+	/** @brief Reads which NUMA node each CPU is on. CPUs that aren't listed (e.g. if there's no NUMA) are on node 0. */
+	std::vector<int> readNodeOfCpu()
+	{
+		std::vector<int> nodeOfCpu;
+		for( int node=0; node<::maximumNumaNodes; ++node )
+		{
+			std::ifstream cpuListFile( "/sys/devices/system/node/node"+std::to_string(node)+"/cpulist" );
+			if( !cpuListFile.is_open() ) continue;
+
+			// The format is a comma separated list of single CPUs or ranges, e.g. "0-7,16-23"
+			std::string range;
+			while( std::getline( cpuListFile, range, ',' ) )
+			{
+				std::istringstream rangeStream( range );
+				int firstCpu=-1, lastCpu=-1;
+				char dash;
+				rangeStream >> firstCpu;
+				if( firstCpu<0 ) continue;
+				if( !(rangeStream >> dash >> lastCpu) ) lastCpu=firstCpu;
+				if( nodeOfCpu.size()<=static_cast<size_t>(lastCpu) ) nodeOfCpu.resize( lastCpu+1, 0 );
+				for( int cpu=firstCpu; cpu<=lastCpu; ++cpu ) nodeOfCpu[cpu]=node;
+			}
+		}
+		return nodeOfCpu;
+	}
+
+	/** @brief Where a module call started. The time is kept in the call stack. */
+	struct CallStart
+	{
+		int cpu;
+		int node;
+		int homeNode;
+		CallStart() : cpu(-1), node(0), homeNode(0) {}
+		CallStart( int newCpu, int newNode, int newHomeNode ) : cpu(newCpu), node(newNode), homeNode(newHomeNode) {}
+	};
+
+	/// Seconds on the steady clock at the start of each call running on this thread
+	thread_local markstools::services::NestedCallStack<double,::CallStart> callStack;
+
+	double steadySeconds()
+	{
+		return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+	}
+
+	struct ModulePlacement
+	{
+		std::string moduleLabel;
+		std::string moduleName;
+		size_t calls;
+		size_t migrations; ///< Calls that finished on a different CPU to the one they started on
+		size_t crossNodeMigrations; ///< Calls that finished on a different NUMA node to the one they started on
+		size_t localCalls;
+		double localTime;
+		size_t remoteCalls;
+		double remoteTime;
+		ModulePlacement() : calls(0), migrations(0), crossNodeMigrations(0), localCalls(0), localTime(0), remoteCalls(0), remoteTime(0) {}
+	};
+
+} // end of the unnamed namespace
+
+//
+// Define the pimple class
+//
+namespace markstools
+{
+	namespace services
+	{
+		class PlacementTrackerPimple
+		{
+		public:
+			PlacementTrackerPimple() : nodeOfCpu_( ::readNodeOfCpu() ), homeNodeOfStream_(1,0) {}
+			int nodeOfCpu( int cpu ) const { return ( cpu>=0 && static_cast<size_t>(cpu)<nodeOfCpu_.size() ) ? nodeOfCpu_[cpu] : 0; }
+
+			std::vector<int> nodeOfCpu_;
+			std::vector<int> homeNodeOfStream_; ///< Each entry is only used by the thread running that stream
+			std::mutex mutex_; ///< Protects modulePlacements_
+			std::vector<::ModulePlacement> modulePlacements_; ///< Indexed by ModuleDescription::id(), entries with no calls are modules that never ran
+		}; // end of the PlacementTrackerPimple class
+
+	} // end of the markstools::services namespace
+} // end of the markstools namespace
+
+markstools::services::PlacementTracker::PlacementTracker()
+	: pImple_( new PlacementTrackerPimple )
+{
+	// No operation besides the initialiser list
+}
+
+markstools::services::PlacementTracker::~PlacementTracker()
+{
+	delete pImple_;
+}
+
+void markstools::services::PlacementTracker::setNumberOfStreams( unsigned int numberOfStreams )
+{
+	pImple_->homeNodeOfStream_.resize( numberOfStreams, 0 );
+}
+
+void markstools::services::PlacementTracker::sourceEventStart( unsigned int streamIndex )
+{
+	pImple_->homeNodeOfStream_[streamIndex]=pImple_->nodeOfCpu( sched_getcpu() );
+}
+
+void markstools::services::PlacementTracker::preModule( unsigned int streamIndex )
+{
+	int cpu=sched_getcpu();
+	::callStack.push( ::CallStart( cpu, pImple_->nodeOfCpu(cpu), pImple_->homeNodeOfStream_[streamIndex] ) )=::steadySeconds();
+}
+
+void markstools::services::PlacementTracker::postModule( const edm::ModuleDescription& description )
+{
+	double timeTaken=::steadySeconds();
+	int cpu=sched_getcpu();
+	// The time is made exclusive of any modules called from this one (unscheduled), but the placement is for the whole call
+	::CallStart start;
+	if( !::callStack.pop( timeTaken, &start ) ) return; // Started before tracking was set up
+
+	std::lock_guard<std::mutex> lock( pImple_->mutex_ );
+	if( pImple_->modulePlacements_.size()<=description.id() ) pImple_->modulePlacements_.resize( description.id()+1 );
+	::ModulePlacement& placement=pImple_->modulePlacements_[description.id()];
+	if( placement.calls==0 )
+	{
+		placement.moduleLabel=description.moduleLabel();
+		placement.moduleName=description.moduleName();
+	}
+	++placement.calls;
+	if( cpu!=start.cpu ) ++placement.migrations;
+	if( pImple_->nodeOfCpu(cpu)!=start.node ) ++placement.crossNodeMigrations;
+	if( start.node==start.homeNode )
+	{
+		++placement.localCalls;
+		placement.localTime+=timeTaken;
+	}
+	else
+	{
+		++placement.remoteCalls;
+		placement.remoteTime+=timeTaken;
+	}
+}
+
+void markstools::services::PlacementTracker::print( std::ostream& output )
+{
+	std::lock_guard<std::mutex> lock( pImple_->mutex_ );
+
+	int numberOfNodes=1;
+	for( const auto node : pImple_->nodeOfCpu_ ) numberOfNodes=std::max( numberOfNodes, node+1 );
+
+	::ModulePlacement total;
+	for( const auto& placement : pImple_->modulePlacements_ )
+	{
+		if( placement.calls==0 ) continue;
+		output << " *PLACEMENT* " << placement.moduleLabel << "," << placement.moduleName << "," << placement.calls
+				<< "," << placement.migrations << "," << placement.crossNodeMigrations << "," << static_cast<double>(placement.crossNodeMigrations)/placement.calls
+				<< "," << placement.localCalls << "," << ( placement.localCalls>0 ? placement.localTime/placement.localCalls : 0 )
+				<< "," << placement.remoteCalls << "," << ( placement.remoteCalls>0 ? placement.remoteTime/placement.remoteCalls : 0 ) << std::endl;
+
+		total.calls+=placement.calls;
+		total.migrations+=placement.migrations;
+		total.crossNodeMigrations+=placement.crossNodeMigrations;
+		total.localCalls+=placement.localCalls;
+		total.localTime+=placement.localTime;
+		total.remoteCalls+=placement.remoteCalls;
+		total.remoteTime+=placement.remoteTime;
+	}
+
+	output << " *PLACEMENT* TOTAL," << numberOfNodes << "," << total.calls << "," << total.migrations << "," << total.crossNodeMigrations
+			<< "," << ( total.calls>0 ? static_cast<double>(total.crossNodeMigrations)/total.calls : 0 )
+			<< "," << total.localCalls << "," << ( total.localCalls>0 ? total.localTime/total.localCalls : 0 )
+			<< "," << total.remoteCalls << "," << ( total.remoteCalls>0 ? total.remoteTime/total.remoteCalls : 0 ) << std::endl;
+}
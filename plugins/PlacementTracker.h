@@ -0,0 +1,57 @@
+#ifndef markstools_services_PlacementTracker_h
+#define markstools_services_PlacementTracker_h
+
+#include <iosfwd>
+
+namespace edm
+{
+	class ModuleDescription;
+}
+
+namespace markstools
+{
+	namespace services
+	{
+		/** @brief Records which CPU and NUMA node each module call ran on, and whether the thread migrated during it.
+		 *
+		 * Not a service in itself, ModuleTimer owns one of these if the "placementReport" parameter is set.
+		 * The CPU is read with sched_getcpu() at the start and end of every call, and converted to a NUMA node
+		 * with a table read from /sys/devices/system/node when this is created.
+		 *
+		 * There's no way of knowing where the event data was actually allocated, so the node that the source
+		 * read the event on is taken as the event's "home" node. A module call is local if it starts on the
+		 * same node as its event's home, and remote otherwise. Most of the event data is allocated either by
+		 * the source or by producers that ran soon after it, so this is a reasonable proxy.
+		 *
+		 * If a module calls other modules (unscheduled) their time is subtracted from its local or remote time,
+		 * so the times are exclusive. Migrations are counted over the whole call.
+		 *
+		 * @author Mark Grimes (mark.grimes@bristol.ac.uk)
+		 * @date 19/Oct/2026
+		 */
+		class PlacementTracker
+		{
+		public:
+			PlacementTracker();
+			virtual ~PlacementTracker();
+
+			void setNumberOfStreams( unsigned int numberOfStreams );
+			/// @brief Records the node the event is being read on as the home node for the stream
+			void sourceEventStart( unsigned int streamIndex );
+			void preModule( unsigned int streamIndex );
+			void postModule( const edm::ModuleDescription& description );
+
+			/// @brief Prints a " *PLACEMENT* " line for each module, plus a summary line for the job
+			void print( std::ostream& output );
+
+			PlacementTracker( const PlacementTracker& otherPlacementTracker ) = delete;
+			PlacementTracker& operator=( const PlacementTracker& otherPlacementTracker ) = delete;
+		private:
+			/// @brief Hide all the private members in a pimple. Google "pimple idiom" for details.
+			class PlacementTrackerPimple* pImple_;
+		}; // end of class PlacementTracker
+
+	} // end of namespace services
+} // end of namespace markstools
+
+#endif // end of #ifndef markstools_services_PlacementTracker_h
@@ -0,0 +1,247 @@
+#include "StartupProfile.h"
+
+#include <link.h>
+#include <unistd.h>
+#include <cstddef>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <set>
+#include <map>
+#include <DataFormats/Provenance/interface/ModuleDescription.h>
+
+//
+// Use the unnamed namespace for things only used in this file.
+//
+namespace
+{
+	typedef std::chrono::steady_clock::time_point TimePoint;
+
+	double secondsBetween( TimePoint start, TimePoint end )
+	{
+		return std::chrono::duration<double>( end-start ).count();
+	}
+
+	/** @brief How long the process has been running, from /proc. Returns zero if it can't be worked out.
+	 *
+	 * Only has the resolution of the kernel clock ticks (usually 10ms) but that's fine for startup. */
+	double processAge()
+	{
+		std::ifstream statFile( "/proc/self/stat" );
+		std::ifstream uptimeFile( "/proc/uptime" );
+		if( !statFile.is_open() || !uptimeFile.is_open() ) return 0;
+
+		std::string statContents( std::istreambuf_iterator<char>(statFile), (std::istreambuf_iterator<char>()) );
+		// The command name in the second field can have spaces in, so start after its closing bracket.
+		// Field 22 is the start time in clock ticks since boot, which is then the 20th field along.
+		std::istringstream fieldStream( statContents.substr( statContents.rfind(')')+1 ) );
+		std::string field;
+		for( int fieldNumber=3; fieldNumber<=22; ++fieldNumber ) fieldStream >> field;
+
+		double uptime=0;
+		uptimeFile >> uptime;
+		double age=uptime-std::stod(field)/sysconf(_SC_CLK_TCK);
+		return age>0 ? age : 0;
+	}
+
+	struct LibraryList
+	{
+		unsigned long long adds; ///< glibc's count of objects ever loaded, so that nothing needs to be compared if it hasn't changed
+		std::set<std::string> names;
+		LibraryList() : adds(0) {}
+	};
+
+	int addLibrary( struct dl_phdr_info* info, size_t size, void* data )
+	{
+		LibraryList& libraries=*static_cast<LibraryList*>(data);
+		if( size>=offsetof(struct dl_phdr_info,dlpi_adds)+sizeof(info->dlpi_adds) ) libraries.adds=info->dlpi_adds;
+		if( info->dlpi_name && info->dlpi_name[0]!='\0' ) libraries.names.insert( info->dlpi_name );
+		return 0;
+	}
+
+	unsigned long long libraryAdds()
+	{
+		unsigned long long adds=0;
+		dl_iterate_phdr( [](struct dl_phdr_info* info, size_t size, void* data){
+			if( size>=offsetof(struct dl_phdr_info,dlpi_adds)+sizeof(info->dlpi_adds) ) *static_cast<unsigned long long*>(data)=info->dlpi_adds;
+			return 1; // The count is the same in every entry, so stop after the first
+		}, &adds );
+		return adds;
+	}
+
+	struct TimelineEntry
+	{
+		double start;
+		double duration;
+		std::string phase; ///< "load", "construction", "beginJob" or "framework"
+		std::string moduleLabel;
+		std::string moduleType;
+		std::vector<std::string> libraries; ///< Libraries that were loaded during this entry
+	};
+
+	struct ModuleTotals
+	{
+		std::string moduleType;
+		double loadTime;
+		double constructionTime;
+		double beginJobTime;
+		size_t libraries;
+		ModuleTotals() : loadTime(0), constructionTime(0), beginJobTime(0), libraries(0) {}
+	};
+
+} // end of the unnamed namespace
+
+//
+// Define the pimple class
+//
+namespace markstools
+{
+	namespace services
+	{
+		class StartupProfilePimple
+		{
+		public:
+			TimePoint processStartTime_; ///< Estimated from how old the process was when this was created
+			TimePoint lastMark_; ///< The end of the last timeline entry
+			::LibraryList libraries_;
+			size_t librariesAtStart_;
+			std::vector<::TimelineEntry> timeline_;
+			std::mutex mutex_;
+
+			/// @brief Closes the current timeline entry at the current time, with the libraries loaded since the last one
+			void mark( const std::string& phase, const edm::ModuleDescription* pDescription );
+		}; // end of the StartupProfilePimple class
+
+	} // end of the markstools::services namespace
+} // end of the markstools namespace
+
+void markstools::services::StartupProfilePimple::mark( const std::string& phase, const edm::ModuleDescription* pDescription )
+{
+	TimePoint now=std::chrono::steady_clock::now();
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	::TimelineEntry entry{ ::secondsBetween(processStartTime_,lastMark_), ::secondsBetween(lastMark_,now), phase, "-", "-", {} };
+	if( pDescription )
+	{
+		entry.moduleLabel=pDescription->moduleLabel();
+		entry.moduleType=pDescription->moduleName();
+	}
+
+	// Only do the full walk of the library list if something has been loaded since last time
+	if( ::libraryAdds()!=libraries_.adds )
+	{
+		::LibraryList current;
+		dl_iterate_phdr( &::addLibrary, &current );
+		for( const auto& name : current.names )
+		{
+			if( libraries_.names.count(name)==0 ) entry.libraries.push_back( name );
+		}
+		libraries_=std::move(current);
+	}
+
+	timeline_.push_back( std::move(entry) );
+	// Don't count the time spent in here against the next entry
+	lastMark_=std::chrono::steady_clock::now();
+}
+
+markstools::services::StartupProfile::StartupProfile()
+	: pImple_( new StartupProfilePimple )
+{
+	pImple_->lastMark_=std::chrono::steady_clock::now();
+	pImple_->processStartTime_=pImple_->lastMark_-std::chrono::duration_cast<std::chrono::steady_clock::duration>( std::chrono::duration<double>(::processAge()) );
+	dl_iterate_phdr( &::addLibrary, &pImple_->libraries_ );
+
+	// Everything up to now (python, ParameterSet processing, services constructed before this one). The libraries
+	// loaded so far aren't listed because there's no way of knowing what loaded them, only the number is printed.
+	pImple_->librariesAtStart_=pImple_->libraries_.names.size();
+	pImple_->timeline_.push_back( ::TimelineEntry{ 0, ::secondsBetween(pImple_->processStartTime_,pImple_->lastMark_), "framework", "-", "-", {} } );
+}
+
+markstools::services::StartupProfile::~StartupProfile()
+{
+	delete pImple_;
+}
+
+void markstools::services::StartupProfile::preModuleConstruction( const edm::ModuleDescription& description )
+{
+	pImple_->mark( "load", &description );
+}
+
+void markstools::services::StartupProfile::postModuleConstruction( const edm::ModuleDescription& description )
+{
+	pImple_->mark( "construction", &description );
+}
+
+void markstools::services::StartupProfile::preModuleBeginJob( const edm::ModuleDescription& description )
+{
+	pImple_->mark( "framework", nullptr );
+}
+
+void markstools::services::StartupProfile::postModuleBeginJob( const edm::ModuleDescription& description )
+{
+	pImple_->mark( "beginJob", &description );
+}
+
+void markstools::services::StartupProfile::print( std::ostream& output )
+{
+	pImple_->mark( "framework", nullptr );
+	std::lock_guard<std::mutex> lock( pImple_->mutex_ );
+
+	std::map<std::string,::ModuleTotals> moduleTotals;
+	::ModuleTotals overallTotals;
+	double frameworkTime=0;
+	for( const auto& entry : pImple_->timeline_ )
+	{
+		output << " *STARTUP* timeline," << entry.start << "," << entry.duration << "," << entry.phase << "," << entry.moduleLabel
+				<< "," << entry.moduleType << "," << entry.libraries.size() << std::endl;
+
+		overallTotals.libraries+=entry.libraries.size();
+		if( entry.moduleLabel=="-" )
+		{
+			frameworkTime+=entry.duration;
+			continue;
+		}
+		::ModuleTotals& totals=moduleTotals[entry.moduleLabel];
+		totals.moduleType=entry.moduleType;
+		totals.libraries+=entry.libraries.size();
+		if( entry.phase=="load" )
+		{
+			totals.loadTime+=entry.duration;
+			overallTotals.loadTime+=entry.duration;
+		}
+		else if( entry.phase=="construction" )
+		{
+			totals.constructionTime+=entry.duration;
+			overallTotals.constructionTime+=entry.duration;
+		}
+		else if( entry.phase=="beginJob" )
+		{
+			totals.beginJobTime+=entry.duration;
+			overallTotals.beginJobTime+=entry.duration;
+		}
+	}
+
+	for( const auto& labelAndTotals : moduleTotals )
+	{
+		const ::ModuleTotals& totals=labelAndTotals.second;
+		output << " *STARTUP* module," << labelAndTotals.first << "," << totals.moduleType << "," << totals.loadTime << "," << totals.constructionTime
+				<< "," << totals.beginJobTime << "," << totals.libraries << std::endl;
+	}
+
+	// Libraries loaded in the same entry can't be told apart, so each gets an equal share of the
+	// entry's time. The number sharing is printed so that the estimate can be judged.
+	for( const auto& entry : pImple_->timeline_ )
+	{
+		for( const auto& library : entry.libraries )
+		{
+			output << " *STARTUP* library," << library << "," << entry.moduleLabel << "," << entry.phase
+					<< "," << entry.duration/entry.libraries.size() << "," << entry.libraries.size() << std::endl;
+		}
+	}
+
+	output << " *STARTUP* total," << pImple_->timeline_.front().duration << "," << frameworkTime << "," << overallTotals.loadTime
+			<< "," << overallTotals.constructionTime << "," << overallTotals.beginJobTime << "," << pImple_->librariesAtStart_ << "," << overallTotals.libraries << std::endl;
+}
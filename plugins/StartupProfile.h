@@ -0,0 +1,55 @@
+#ifndef markstools_services_StartupProfile_h
+#define markstools_services_StartupProfile_h
+
+#include <string>
+#include <iosfwd>
+
+namespace edm
+{
+	class ModuleDescription;
+}
+
+namespace markstools
+{
+	namespace services
+	{
+		/** @brief Builds a timeline of the job startup, including which shared libraries got loaded when.
+		 *
+		 * Not a service in itself, ModuleTimer owns one of these if the "startupProfile" parameter is set.
+		 * The libraries that are loaded are found with dl_iterate_phdr at each module transition. The plugin
+		 * library for a module gets loaded by the plugin factory just before its preModuleConstruction signal,
+		 * so anything that appears between the end of the previous module's construction and the start of this
+		 * one's is counted as that module's library load. Anything loaded during construction or beginJob is
+		 * attributed to the module running at the time.
+		 *
+		 * Times are seconds since the process started, so the first entry covers the python configuration,
+		 * ParameterSet processing and service construction before ModuleTimer existed.
+		 *
+		 * @author Mark Grimes (mark.grimes@bristol.ac.uk)
+		 * @date 19/Oct/2026
+		 */
+		class StartupProfile
+		{
+		public:
+			StartupProfile();
+			virtual ~StartupProfile();
+
+			void preModuleConstruction( const edm::ModuleDescription& description );
+			void postModuleConstruction( const edm::ModuleDescription& description );
+			void preModuleBeginJob( const edm::ModuleDescription& description );
+			void postModuleBeginJob( const edm::ModuleDescription& description );
+
+			/// @brief Prints the " *STARTUP* " lines for the timeline, then the totals per module and per library
+			void print( std::ostream& output );
+
+			StartupProfile( const StartupProfile& otherStartupProfile ) = delete;
+			StartupProfile& operator=( const StartupProfile& otherStartupProfile ) = delete;
+		private:
+			/// @brief Hide all the private members in a pimple. Google "pimple idiom" for details.
+			class StartupProfilePimple* pImple_;
+		}; // end of class StartupProfile
+
+	} // end of namespace services
+} // end of namespace markstools
+
+#endif // end of #ifndef markstools_services_StartupProfile_h
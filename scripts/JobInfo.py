@@ -11,6 +11,17 @@ class MemoryLog :
     def addProductSize( self, productSize ) :
         self.productSize=float(productSize)/MemoryLog.MemScale
 
+class ModuleRetainedMemoryLog :
+    """ The memory retained by a module in one event and released when the event was cleared. This is for the
+    whole module, not per product: the products it put are listed, but the memory can't be split between them
+    and includes anything else the module kept. If undisturbed is False another
+    stream used the same module's counter at the same time, so the numbers include that stream's changes. """
+    def __init__( self, moduleRetainedMemory, moduleReleasedMemory, undisturbed, products ) :
+        self.moduleRetainedMemory=float(moduleRetainedMemory)/MemoryLog.MemScale
+        self.moduleReleasedMemory=float(moduleReleasedMemory)/MemoryLog.MemScale
+        self.undisturbed=( int(undisturbed)!=0 )
+        self.products=products.split(';')
+
 class TimeLog :
     def __init__( self, real, user, sys ) :
         self.real=float(real)/1000000000000.0
@@ -25,6 +36,7 @@ class ModuleInfo :
         self.type=columns[2]
         self.steps={}
         self.timeSteps={}
+        self.retainedSteps={}
         #self.addStep( columns )
 
     def addStep( self, columns ) :
@@ -47,6 +59,12 @@ class ModuleInfo :
         
         self.timeSteps[columns[0]]=TimeLog(columns[3],columns[4],columns[5])
 
+    def addRetainedStep( self, columns ) :
+        if len(columns)<7 : raise Exception("Not enough columns")
+        if self.name!=columns[1] : raise Exception("Trying to add step from an incorrect module name")
+
+        self.retainedSteps[columns[0]]=ModuleRetainedMemoryLog(columns[3],columns[4],columns[5],columns[6].strip())
+
 class JobInfo :
     def __init__(self):
         self.modules = {}
@@ -104,6 +122,8 @@ class JobInfo :
             self.addStep( line[15:].split(','), True )
         elif line[:14]==" *MEMCOUNTER* " :
             self.addStep( line[14:].split(','), False )
+        elif line[:18]==" *MODULERETAINED* " :
+            self.addRetainedStep( line[18:].split(',') )
         else :
             # I want to ignore all other lines in the cmsRun output. I might have been
             # fed a log of the RSS use though. I need to see if the line fits what that
@@ -137,6 +157,15 @@ class JobInfo :
             currentModule.addTimeStep( columns )
         else :
             currentModule.addStep( columns )
+    def addRetainedStep( self, columns ) :
+        moduleName=columns[1]
+        try :
+            currentModule=self.modules[moduleName]
+        except KeyError :
+            currentModule=ModuleInfo(columns)
+            self.modules[moduleName]=currentModule
+        currentModule.addRetainedStep( columns )
+
     def addRSS( self, columns ) :
         self.rss.append( float(columns[7])/1024.0 )
 
@@ -0,0 +1,223 @@
+"""
+Runs the synthetic workload modules (test/SyntheticWorkloads.cc) under each of the services, single and
+multi-threaded, and checks that what the services report matches what the modules are known to do.
+
+    validateBenchmarks.py [--events N] [--threads 1,4] [--services ModuleTimer,MemoryCounter,CheckRSSService] [--keep]
+
+Needs a CMSSW environment with this package built. MemoryCounter is run under intrusiveMemoryAnalyser with
+cmsRunGlibC, so that needs to be on the path too. Prints a PASS, FAIL or SKIP line for every check and exits
+with a non zero code if anything failed. With --keep the configurations and logs are left in the working directory.
+
+Anything that can't be run here is skipped rather than failed, so that this can be the package's unit test
+("scram b runtests", see test/BuildFile.xml): MemoryCounter if MemCounter isn't installed, and everything if
+cmsRun isn't on the path. ModuleTimer's CPU times are for the whole process, so with more than one thread
+they include the other threads and only its real time is checked.
+"""
+import sys, os, subprocess, tempfile, shutil, math
+
+MiB=1024*1024
+
+# What each synthetic module is set up to do. The checks below are written in terms of these.
+cpuSeconds=0.02
+sleepSeconds=0.02
+churnSize=4096
+churnAllocations=1000
+leakBytes=MiB
+delayedReleaseEvents=5
+spikeBytes=256*MiB
+spikeInterval=10
+
+configTemplate="""import FWCore.ParameterSet.Config as cms
+process = cms.Process("VALIDATE")
+process.source = cms.Source("EmptySource")
+process.maxEvents = cms.untracked.PSet( input = cms.untracked.int32(%(events)d) )
+process.options = cms.untracked.PSet( numberOfThreads = cms.untracked.uint32(%(threads)d), numberOfStreams = cms.untracked.uint32(%(threads)d) )
+
+process.cpuBurn = cms.EDAnalyzer( "SyntheticCpuBurn", cpuSeconds = cms.double(%(cpuSeconds)g) )
+process.sleep = cms.EDAnalyzer( "SyntheticSleep", sleepSeconds = cms.double(%(sleepSeconds)g) )
+process.churn = cms.EDAnalyzer( "SyntheticAllocationChurn", allocationSize = cms.uint32(%(churnSize)d), allocationsPerEvent = cms.uint32(%(churnAllocations)d) )
+process.leak = cms.EDAnalyzer( "SyntheticLeak", bytesPerEvent = cms.uint32(%(leakBytes)d) )
+process.delayedRelease = cms.EDAnalyzer( "SyntheticLeak", bytesPerEvent = cms.uint32(%(leakBytes)d), holdForEvents = cms.uint32(%(delayedReleaseEvents)d) )
+process.spike = cms.EDAnalyzer( "SyntheticSpike", spikeBytes = cms.uint32(%(spikeBytes)d), spikeInterval = cms.uint32(%(spikeInterval)d) )
+process.path = cms.Path( process.cpuBurn+process.sleep+process.churn+process.leak+process.delayedRelease+process.spike )
+
+process.%(service)s = cms.Service( "%(service)s" )
+"""
+
+def median( values ) :
+    if len(values)==0 : return float('nan')
+    values=sorted(values)
+    middle=len(values)//2
+    return values[middle] if len(values)%2==1 else 0.5*(values[middle-1]+values[middle])
+
+def findExecutable( name ) :
+    """ Returns the full path of the executable, or None if it isn't on the path """
+    for directory in os.environ.get( "PATH", "" ).split( os.pathsep ) :
+        filename=os.path.join( directory, name )
+        if os.path.isfile( filename ) and os.access( filename, os.X_OK ) : return filename
+    return None
+
+class Results :
+    def __init__( self ) :
+        self.failures=0
+        self.skips=0
+    def skip( self, description, reason ) :
+        self.skips+=1
+        print( "SKIP %s: %s" % ( description, reason ) )
+    def check( self, description, expected, measured, tolerance ) :
+        """ tolerance is absolute. A NaN measurement (nothing was reported) always fails. """
+        passed=( not math.isnan(measured) and abs(measured-expected)<=tolerance )
+        if not passed : self.failures+=1
+        print( "%s %s: expected %g +/- %g, got %g" % ( "PASS" if passed else "FAIL", description, expected, tolerance, measured ) )
+    def checkBelow( self, description, limit, measured ) :
+        passed=( not math.isnan(measured) and measured<=limit )
+        if not passed : self.failures+=1
+        print( "%s %s: expected at most %g, got %g" % ( "PASS" if passed else "FAIL", description, limit, measured ) )
+
+#
+# Parsing of the lines printed by each service, keyed on module label. Each entry is a list in the order
+# printed, which under threads isn't necessarily the event order.
+#
+def parseModuleTimer( lines ) :
+    """ Returns {label:[(realSeconds,cpuSeconds)]} for the event lines. The times are printed in nanoseconds. """
+    modules={}
+    for line in lines :
+        if line[:15]!=" *MODULETIMER* " : continue
+        columns=line[15:].strip().split(',')
+        if columns[0][:5]!="event" or columns[1]=="EVENT" : continue
+        modules.setdefault( columns[1], [] ).append( ( float(columns[3])*1e-9, (float(columns[4])+float(columns[5]))*1e-9 ) )
+    return modules
+
+def parseMemoryCounter( lines ) :
+    """ Returns {label:[(currentBytes,maximumBytes)]} for the event lines """
+    modules={}
+    for line in lines :
+        if line[:14]!=" *MEMCOUNTER* " : continue
+        columns=line[14:].strip().split(',')
+        if columns[0][:5]!="event" : continue
+        modules.setdefault( columns[1], [] ).append( ( float(columns[3]), float(columns[4]) ) )
+    return modules
+
+def parseCheckRSS( lines ) :
+    """ Returns {label:[rssChangeInBytes]} for each event call, matching each end with the earliest unmatched start """
+    starts={}
+    modules={}
+    for line in lines :
+        columns=line.split()
+        if len(columns)<6 or columns[0]!="*RSSDUMP*" : continue
+        step, label, rss=columns[1], columns[2], float(columns[5])*1024
+        if step[:11]=="Start_Event" : starts.setdefault( label, [] ).append( rss )
+        elif step[:9]=="End_Event" and len(starts.get(label,[]))>0 : modules.setdefault( label, [] ).append( rss-starts[label].pop(0) )
+    return modules
+
+#
+# The checks for each service
+#
+def checkModuleTimer( lines, threads, events, results ) :
+    prefix="ModuleTimer threads=%d" % threads
+    modules=parseModuleTimer( lines )
+    results.check( prefix+" sleep real seconds", sleepSeconds, median( [real for real, cpu in modules.get("sleep",[])] ), 0.15*sleepSeconds )
+    # ModuleTimer uses process_cpu_clock, so with other threads busy a module's CPU time includes theirs
+    if threads>1 :
+        results.skip( prefix+" CPU seconds", "ModuleTimer's CPU times are for the whole process" )
+        return
+    results.check( prefix+" cpuBurn CPU seconds", cpuSeconds, median( [cpu for real, cpu in modules.get("cpuBurn",[])] ), 0.15*cpuSeconds )
+    results.checkBelow( prefix+" sleep CPU seconds", 0.1*sleepSeconds, median( [cpu for real, cpu in modules.get("sleep",[])] ) )
+
+def checkMemoryCounter( lines, threads, events, results ) :
+    prefix="MemoryCounter threads=%d" % threads
+    modules=parseMemoryCounter( lines )
+
+    churn=modules.get( "churn", [] )
+    results.check( prefix+" churn peak bytes per event", churnSize*churnAllocations, median( [maximum-current for current, maximum in churn] ), 0.05*churnSize*churnAllocations )
+    results.checkBelow( prefix+" churn held bytes growth", MiB, churn[-1][0]-churn[0][0] if len(churn)>0 else float('nan') )
+
+    leak=modules.get( "leak", [] )
+    results.check( prefix+" leak held bytes per event", leakBytes, (leak[-1][0]-leak[0][0])/(len(leak)-1) if len(leak)>1 else float('nan'), 0.05*leakBytes )
+
+    # Every stream has its own copy of the module, and each copy holds on to the last few events' worth
+    delayedRelease=modules.get( "delayedRelease", [] )
+    expectedHeld=min( events, delayedReleaseEvents*threads )*leakBytes
+    results.check( prefix+" delayedRelease held bytes at end", expectedHeld, delayedRelease[-1][0] if len(delayedRelease)>0 else float('nan'), 0.1*expectedHeld+MiB )
+
+    spike=modules.get( "spike", [] )
+    results.check( prefix+" spike peak bytes", spikeBytes, max( [maximum-current for current, maximum in spike] ) if len(spike)>0 else float('nan'), 0.05*spikeBytes )
+    results.checkBelow( prefix+" spike held bytes growth", MiB, spike[-1][0]-spike[0][0] if len(spike)>0 else float('nan') )
+    # Each stream spikes on its own first event then every spikeInterval after, so there are a few more with more streams
+    spikeEvents=len( [1 for current, maximum in spike if maximum-current>=0.5*spikeBytes] )
+    minimumSpikes=int( math.ceil( float(events)/spikeInterval ) )
+    results.check( prefix+" spike events", minimumSpikes+0.5*(threads-1), spikeEvents, 0.5*(threads-1)+0.5 )
+
+def checkCheckRSS( lines, threads, events, results ) :
+    prefix="CheckRSSService threads=%d" % threads
+    modules=parseCheckRSS( lines )
+    results.check( prefix+" leak RSS change per event", leakBytes, median( modules.get("leak",[]) ), 0.1*leakBytes )
+    # Both of these give their memory back before the module ends, so there should be nothing to see at the boundaries
+    results.check( prefix+" spike RSS change per event", 0, median( modules.get("spike",[]) ), 0.1*leakBytes )
+    results.check( prefix+" churn RSS change per event", 0, median( modules.get("churn",[]) ), 0.1*leakBytes )
+
+serviceChecks={ "ModuleTimer":checkModuleTimer, "MemoryCounter":checkMemoryCounter, "CheckRSSService":checkCheckRSS }
+
+# MemoryCounter prints this if the MemCounter library wasn't preloaded, e.g. if intrusiveMemoryAnalyser is a stub
+memCounterMissing="couldn't get the symbol in the analysing library"
+
+def missingExecutables( service ) :
+    """ Returns the executables the service needs that aren't on the path """
+    needed=[ "cmsRun" ]
+    if service=="MemoryCounter" : needed+=[ "intrusiveMemoryAnalyser", "cmsRunGlibC" ]
+    return [ name for name in needed if findExecutable(name) is None ]
+
+def runJob( service, threads, events, workingDirectory ) :
+    """ Runs cmsRun with the synthetic modules and the given service, and returns the lines of the output """
+    parameters=dict( globals() )
+    parameters.update( { "service":service, "threads":threads, "events":events } )
+    configFilename=os.path.join( workingDirectory, "validate%s_%dthreads_cfg.py" % (service,threads) )
+    logFilename=os.path.join( workingDirectory, "validate%s_%dthreads.log" % (service,threads) )
+    with open( configFilename, 'w' ) as configFile :
+        configFile.write( configTemplate % parameters )
+
+    command=[ "cmsRun", configFilename ]
+    if service=="MemoryCounter" : command=[ "intrusiveMemoryAnalyser", "cmsRunGlibC", configFilename ]
+    with open( logFilename, 'w' ) as logFile :
+        returnCode=subprocess.call( command, stdout=logFile, stderr=subprocess.STDOUT )
+    with open( logFilename ) as logFile :
+        lines=logFile.readlines()
+    if returnCode!=0 : print( "WARNING: '%s' returned %d, see %s" % ( " ".join(command), returnCode, logFilename ) )
+    return lines
+
+if __name__ == '__main__':
+    events=50
+    threadCounts=[1,4]
+    services=["ModuleTimer","MemoryCounter","CheckRSSService"]
+    keep=False
+
+    arguments=sys.argv[1:]
+    while len(arguments)>0 :
+        argument=arguments.pop(0)
+        if argument=="--events" : events=int( arguments.pop(0) )
+        elif argument=="--threads" : threadCounts=[ int(count) for count in arguments.pop(0).split(',') ]
+        elif argument=="--services" : services=arguments.pop(0).split(',')
+        elif argument=="--keep" : keep=True
+        else :
+            print( __doc__ )
+            sys.exit( 0 if argument in ["-h","--help"] else -1 )
+
+    workingDirectory=os.getcwd() if keep else tempfile.mkdtemp( prefix="validateBenchmarks" )
+    results=Results()
+    try :
+        for service in services :
+            missing=missingExecutables( service )
+            if len(missing)>0 :
+                results.skip( service, "%s not on the path" % ", ".join(missing) )
+                continue
+            for threads in threadCounts :
+                lines=runJob( service, threads, events, workingDirectory )
+                if service=="MemoryCounter" and any( memCounterMissing in line for line in lines ) :
+                    results.skip( "%s threads=%d" % (service,threads), "the MemCounter library wasn't preloaded" )
+                    continue
+                serviceChecks[service]( lines, threads, events, results )
+    finally :
+        if not keep : shutil.rmtree( workingDirectory )
+
+    print( "%d checks failed, %d skipped" % ( results.failures, results.skips ) )
+    sys.exit( 1 if results.failures>0 else 0 )
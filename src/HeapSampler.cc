@@ -0,0 +1,286 @@
+#include "MarksTools/Benchmarking/interface/HeapSampler.h"
+#include "MarksTools/Benchmarking/interface/SymbolName.h"
+#include "MarksTools/Benchmarking/interface/AllocationObserver.h"
+#include "MarksTools/Benchmarking/interface/StackWalk.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstdint>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <iostream>
+
+//
+// Unnamed namespace for things only used in this file
+//
+namespace
+{
+	/// The deepest stack that will be recorded. Anything deeper is truncated at the outermost end.
+	const int maximumStackDepth=64;
+
+	/// Frames at the top of each stack that are inside the sampler (recordSample and allocated), so not interesting
+	const int framesToSkip=2;
+
+	/// Number of bits used to index the filter of possibly sampled pointers
+	const int filterBits=20;
+	/// A filter entry that reaches this stays there for good, since it's no longer known how many pointers it stands for
+	const uint8_t saturatedCount=255;
+
+	// Per thread state. There is only ever one HeapSampler (owned by the MemoryCounter service) so there's
+	// no need to key these on the instance. These are first touched from inside the allocation hook, and
+	// dynamic TLS in a dlopen'd library can call malloc on first use on a new thread, which would re-enter
+	// the hook before insideSampler exists. The initial exec model puts them in the static TLS block that
+	// every thread gets when it's created, which is why they're kept to a few plain values.
+	thread_local long int bytesUntilSample __attribute__((tls_model("initial-exec")))=-1; ///< Negative means it hasn't been drawn yet for this thread
+	thread_local uint64_t randomState __attribute__((tls_model("initial-exec")))=0;
+	thread_local bool insideSampler __attribute__((tls_model("initial-exec")))=false; ///< Stops the sampler recording its own allocations
+
+	/// @brief Stops the sampler being re-entered on the current thread for the lifetime of the instance
+	struct ReentrancyGuard
+	{
+		ReentrancyGuard() { insideSampler=true; }
+		~ReentrancyGuard() { insideSampler=false; }
+	};
+
+	/** @brief Draws from an exponential distribution with the given mean. Uses xorshift64* because it doesn't allocate. */
+	long int nextSampleInterval( size_t meanSampleInterval )
+	{
+		if( randomState==0 ) randomState=reinterpret_cast<uintptr_t>(&randomState) ^ std::chrono::high_resolution_clock::now().time_since_epoch().count() ^ 0x9E3779B97F4A7C15ULL;
+		randomState^=randomState>>12;
+		randomState^=randomState<<25;
+		randomState^=randomState>>27;
+		// Top 53 bits make a double in [0,1), so flip it to (0,1] to keep the log finite
+		double uniform=1.0-static_cast<double>( (randomState*0x2545F4914F6CDD1DULL)>>11 )/9007199254740992.0;
+		return static_cast<long int>( -std::log(uniform)*meanSampleInterval )+1;
+	}
+
+	size_t hashPointer( void* pointer )
+	{
+		uint64_t value=reinterpret_cast<uintptr_t>(pointer);
+		value^=value>>33;
+		value*=0xff51afd7ed558ccdULL;
+		value^=value>>33;
+		return static_cast<size_t>(value);
+	}
+
+	struct StackHash
+	{
+		size_t operator()( const std::vector<void*>& stack ) const
+		{
+			size_t hash=stack.size();
+			for( const auto pointer : stack ) hash=hash*31+hashPointer(pointer);
+			return hash;
+		}
+	};
+
+	/** @brief Totals for one call site (i.e. one interned stack) in one module */
+	struct SiteStatistics
+	{
+		double allocatedBytes;
+		double liveBytes;
+		size_t samples;
+		SiteStatistics() : allocatedBytes(0), liveBytes(0), samples(0) {}
+	};
+
+	struct LiveSample
+	{
+		size_t moduleIndex;
+		size_t stackIndex;
+		double weightedBytes;
+	};
+
+} // end of the unnamed namespace
+
+//
+// Define the pimple class
+//
+namespace markstools
+{
+	namespace services
+	{
+		class HeapSamplerPimple
+		{
+		public:
+			/** @brief The object the intrusiveMemoryAnalyser calls for one module's counter */
+			class ModuleObserver : public markstools::services::IAllocationObserver
+			{
+			public:
+				ModuleObserver( HeapSamplerPimple* pSampler, size_t moduleIndex, const std::string& label, const std::string& type )
+					: pSampler_(pSampler), moduleIndex_(moduleIndex), label_(label), type_(type) {}
+				virtual ~ModuleObserver() {}
+				virtual void allocated( void* pointer, size_t size ) override;
+				virtual void deallocated( void* pointer ) override;
+
+				HeapSamplerPimple* pSampler_;
+				size_t moduleIndex_;
+				std::string label_;
+				std::string type_;
+			};
+		public:
+			HeapSamplerPimple( size_t meanSampleInterval ) : meanSampleInterval_(meanSampleInterval), maybeSampled_( new std::atomic<uint8_t>[1<<::filterBits] )
+			{
+				for( size_t index=0; index<(1<<::filterBits); ++index ) maybeSampled_[index].store( 0, std::memory_order_relaxed );
+			}
+			void recordSample( size_t moduleIndex, void* pointer, size_t size );
+			void removeSample( void* pointer );
+
+			size_t meanSampleInterval_;
+			std::vector<std::unique_ptr<ModuleObserver> > observers_;
+
+			/** @brief Counting filter of pointers that might be sampled. Lets the free of an unsampled pointer (nearly every
+			 * free) return without taking the lock. A count is used rather than a bit so that entries can be removed.
+			 * The counts are only changed with mutex_ held, and saturate rather than wrap. A saturated entry only
+			 * means the frees that hash to it always take the lock. */
+			std::unique_ptr<std::atomic<uint8_t>[]> maybeSampled_;
+			std::atomic<uint8_t>& filterEntry( void* pointer ) { return maybeSampled_[::hashPointer(pointer)&((1<<::filterBits)-1)]; }
+
+			mutable std::mutex mutex_; ///< Protects everything below
+			std::unordered_map<std::vector<void*>,size_t,::StackHash> stackIndices_; ///< The hash-consed stack table
+			std::vector<const std::vector<void*>*> stacks_; ///< Lookup from stack index to the stack, pointing into stackIndices_
+			std::map<std::pair<size_t,size_t>,::SiteStatistics> siteStatistics_; ///< Keyed on module index and stack index
+			std::unordered_map<void*,::LiveSample> liveSamples_;
+		}; // end of the HeapSamplerPimple class
+
+	} // end of the markstools::services namespace
+} // end of the markstools namespace
+
+void markstools::services::HeapSamplerPimple::ModuleObserver::allocated( void* pointer, size_t size )
+{
+	if( ::insideSampler ) return;
+
+	if( ::bytesUntilSample<0 ) ::bytesUntilSample=::nextSampleInterval( pSampler_->meanSampleInterval_ );
+	::bytesUntilSample-=size;
+	if( ::bytesUntilSample>=0 ) return; // The usual case, so keep it to the subtraction
+
+	::ReentrancyGuard guard;
+	// Don't carry a large deficit over, otherwise one big allocation would stop sampling for a long time
+	::bytesUntilSample=::nextSampleInterval( pSampler_->meanSampleInterval_ );
+	pSampler_->recordSample( moduleIndex_, pointer, size );
+}
+
+void markstools::services::HeapSamplerPimple::ModuleObserver::deallocated( void* pointer )
+{
+	if( ::insideSampler ) return;
+	if( pSampler_->filterEntry(pointer).load( std::memory_order_relaxed )==0 ) return;
+
+	::ReentrancyGuard guard;
+	pSampler_->removeSample( pointer );
+}
+
+void markstools::services::HeapSamplerPimple::recordSample( size_t moduleIndex, void* pointer, size_t size )
+{
+	// Taken before the lock and without the libgcc unwinder, which can lock and allocate. See StackWalk.h.
+	void* frames[::maximumStackDepth];
+	int depth=markstools::services::walkFramePointersFromHere( frames, ::maximumStackDepth );
+	std::vector<void*> stack( frames+std::min(depth,::framesToSkip), frames+depth );
+
+	// Each sample stands for all the bytes since the last one. This is the same unbiased estimate
+	// that pprof uses to unsample tcmalloc profiles.
+	double sizeAsDouble=static_cast<double>(size);
+	double weightedBytes=sizeAsDouble/( 1.0-std::exp(-sizeAsDouble/meanSampleInterval_) );
+
+	std::lock_guard<std::mutex> lock( mutex_ );
+	auto insertResult=stackIndices_.insert( std::make_pair( std::move(stack), stacks_.size() ) );
+	if( insertResult.second ) stacks_.push_back( &insertResult.first->first );
+	size_t stackIndex=insertResult.first->second;
+
+	::SiteStatistics& statistics=siteStatistics_[std::make_pair(moduleIndex,stackIndex)];
+	statistics.allocatedBytes+=weightedBytes;
+	statistics.liveBytes+=weightedBytes;
+	++statistics.samples;
+
+	auto sampleInsert=liveSamples_.insert( std::make_pair( pointer, ::LiveSample{ moduleIndex, stackIndex, weightedBytes } ) );
+	if( !sampleInsert.second )
+	{
+		// The address was handed out again without its free being seen, so the old sample must be gone. It's already in the filter.
+		::LiveSample& oldSample=sampleInsert.first->second;
+		siteStatistics_[std::make_pair(oldSample.moduleIndex,oldSample.stackIndex)].liveBytes-=oldSample.weightedBytes;
+		oldSample=::LiveSample{ moduleIndex, stackIndex, weightedBytes };
+		return;
+	}
+	std::atomic<uint8_t>& entry=filterEntry( pointer );
+	uint8_t count=entry.load( std::memory_order_relaxed );
+	if( count<::saturatedCount ) entry.store( count+1, std::memory_order_relaxed );
+}
+
+void markstools::services::HeapSamplerPimple::removeSample( void* pointer )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+	auto iSample=liveSamples_.find( pointer );
+	if( iSample==liveSamples_.end() ) return; // Filter false positive
+
+	siteStatistics_[std::make_pair(iSample->second.moduleIndex,iSample->second.stackIndex)].liveBytes-=iSample->second.weightedBytes;
+	liveSamples_.erase( iSample );
+	std::atomic<uint8_t>& entry=filterEntry( pointer );
+	uint8_t count=entry.load( std::memory_order_relaxed );
+	if( count<::saturatedCount ) entry.store( count-1, std::memory_order_relaxed );
+}
+
+markstools::services::HeapSampler::HeapSampler( size_t meanSampleInterval )
+	: pImple_( new HeapSamplerPimple(meanSampleInterval) )
+{
+	// No operation besides the initialiser list
+}
+
+markstools::services::HeapSampler::~HeapSampler()
+{
+	delete pImple_;
+}
+
+markstools::services::IAllocationObserver* markstools::services::HeapSampler::observerForModule( const std::string& moduleLabel, const std::string& moduleType )
+{
+	pImple_->observers_.emplace_back( new HeapSamplerPimple::ModuleObserver( pImple_, pImple_->observers_.size(), moduleLabel, moduleType ) );
+	return pImple_->observers_.back().get();
+}
+
+void markstools::services::HeapSampler::writeFoldedStacks( std::ostream& output, bool liveBytes ) const
+{
+	::ReentrancyGuard guard;
+	std::lock_guard<std::mutex> lock( pImple_->mutex_ );
+
+	std::unordered_map<void*,std::string> symbolCache;
+	for( const auto& siteAndStatistics : pImple_->siteStatistics_ )
+	{
+		double bytes=( liveBytes ? siteAndStatistics.second.liveBytes : siteAndStatistics.second.allocatedBytes );
+		if( bytes<0.5 ) continue;
+
+		output << pImple_->observers_[siteAndStatistics.first.first]->label_;
+		const std::vector<void*>& stack=*pImple_->stacks_[siteAndStatistics.first.second];
+		// The stacks have the innermost frame first, but the folded format wants the outermost first
+		for( auto iFrame=stack.rbegin(); iFrame!=stack.rend(); ++iFrame )
+		{
+			auto iSymbol=symbolCache.find( *iFrame );
+			if( iSymbol==symbolCache.end() ) iSymbol=symbolCache.insert( std::make_pair( *iFrame, markstools::services::symbolName(*iFrame) ) ).first;
+			output << ";" << iSymbol->second;
+		}
+		output << " " << static_cast<long int>( bytes+0.5 ) << "\n";
+	}
+}
+
+void markstools::services::HeapSampler::printSummary( std::ostream& output ) const
+{
+	::ReentrancyGuard guard;
+	std::lock_guard<std::mutex> lock( pImple_->mutex_ );
+
+	std::vector<::SiteStatistics> moduleTotals( pImple_->observers_.size() );
+	for( const auto& siteAndStatistics : pImple_->siteStatistics_ )
+	{
+		::SiteStatistics& total=moduleTotals[siteAndStatistics.first.first];
+		total.allocatedBytes+=siteAndStatistics.second.allocatedBytes;
+		total.liveBytes+=siteAndStatistics.second.liveBytes;
+		total.samples+=siteAndStatistics.second.samples;
+	}
+
+	for( size_t moduleIndex=0; moduleIndex<moduleTotals.size(); ++moduleIndex )
+	{
+		output << " *HEAPSAMPLE* " << pImple_->observers_[moduleIndex]->label_ << "," << pImple_->observers_[moduleIndex]->type_
+				<< "," << static_cast<long int>( moduleTotals[moduleIndex].allocatedBytes+0.5 ) << "," << static_cast<long int>( moduleTotals[moduleIndex].liveBytes+0.5 )
+				<< "," << moduleTotals[moduleIndex].samples << std::endl;
+	}
+}
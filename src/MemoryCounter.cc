@@ -1,8 +1,15 @@
 #include "MarksTools/Benchmarking/interface/MemoryCounter.h"
+#include "MarksTools/Benchmarking/interface/HeapSampler.h"
+#include "MarksTools/Benchmarking/interface/AllocationObserver.h"
+#include "MarksTools/Benchmarking/interface/QuantileSketch.h"
+#include "MarksTools/Benchmarking/interface/TransitionName.h"
 
 #include <DataFormats/Provenance/interface/ModuleDescription.h>
+#include <DataFormats/Provenance/interface/BranchDescription.h>
+#include "FWCore/Framework/interface/ConstProductRegistry.h"
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
 #include "FWCore/ServiceRegistry/interface/ActivityRegistry.h"
+#include "FWCore/ServiceRegistry/interface/Service.h"
 
 // The signals in ActivityRegistry changed drastically to cover threaded
 // use, so I need to conditionally compile certain things depending on the
@@ -12,12 +19,15 @@
 #ifdef AR_WATCH_USING_METHOD_3
 #	define MEMORYCOUNTER_USE_NEW_ACTIVITYREGISTRY_SIGNALS
 #	include "FWCore/ServiceRegistry/interface/ModuleCallingContext.h"
+#	include "FWCore/ServiceRegistry/interface/StreamContext.h"
 #endif
 
 #include <dlfcn.h>
 
 #include <iostream>
 #include <fstream>
+#include <mutex>
+#include <memory>
 
 // This is the interface from the memory counter program. The include location is set in
 // the BuildFile.xml.
@@ -32,9 +42,39 @@ namespace
 	{
 		memcounter::IMemoryCounter* pMemoryCounter;
 		long int previousRecordedSize;
-		std::string previousEvent;
-		ModuleDetails() : pMemoryCounter(nullptr), previousRecordedSize(-1) {}
-		ModuleDetails( memcounter::IMemoryCounter* pNewCounter ) : pMemoryCounter(pNewCounter), previousRecordedSize(-1) {}
+		markstools::services::TransitionName previousEvent;
+		long int sizeAtEnable; ///< currentSize when the counter was last enabled, so that the retained size of a single call can be worked out
+		std::string products; ///< The event products this module puts, as "friendlyClassName_label_instance" separated by ';'. Empty if it puts none.
+		std::string moduleName;
+		markstools::services::QuantileSketch heldSketch; ///< Distribution over events of the memory held after the module, only filled if "sketchFilename" is set
+		markstools::services::QuantileSketch peakSketch; ///< Same as heldSketch but for the peak during the module
+		/// Protects the sketches, since the same module can finish on several streams at once. A pointer so that ModuleDetails can still be moved into the map.
+		std::unique_ptr<std::mutex> pSketchMutex;
+		// The counter is shared between streams, so these keep track of whether anything else could have changed it
+		// while a product record was waiting. Only used if "recordModuleRetainedMemory" is set, and protected by productMutex_.
+		unsigned int eventsInFlight; ///< Streams that have started an event call of this module and not yet released the products
+		unsigned long disturbances; ///< Goes up whenever one stream could change the counter while another stream has an event in flight
+		std::vector<unsigned long> disturbancesAtStartByStream;
+		ModuleDetails() : pMemoryCounter(nullptr), previousRecordedSize(-1), sizeAtEnable(0), pSketchMutex(new std::mutex), eventsInFlight(0), disturbances(0) {}
+		ModuleDetails( memcounter::IMemoryCounter* pNewCounter, const std::string& newModuleName, double sketchAccuracy )
+			: pMemoryCounter(pNewCounter), previousRecordedSize(-1), sizeAtEnable(0), moduleName(newModuleName), heldSketch(sketchAccuracy), peakSketch(sketchAccuracy),
+			  pSketchMutex(new std::mutex), eventsInFlight(0), disturbances(0) {}
+	};
+
+	/** @brief Memory retained by a module in one event, kept until the event is cleared so that the release can be measured.
+	 *
+	 * MemCounter counts per module, so this is the module's retained memory: its products plus anything else it
+	 * kept hold of. It can't be split between the products, which are only listed to show what it put.
+	 */
+	struct RetainedMemoryRecord
+	{
+		const std::string* pModuleLabel;
+		const std::string* pModuleName;
+		ModuleDetails* pModuleDetails;
+		markstools::services::TransitionName event;
+		long int retainedSize; ///< Size held by the counter after the module call minus the size before it
+		long int sizeAfterModule; ///< Absolute counter size after the module call, to compare with when the event is cleared
+		unsigned long disturbancesAtStart; ///< ModuleDetails::disturbances when the call started. If it's changed by the release, another stream may have changed the counter.
 	};
 
 } // end of the unnamed namespace
@@ -49,28 +89,74 @@ namespace markstools
 		class MemoryCounterPimple
 		{
 		public:
-			MemoryCounterPimple() : eventNumber_(1), lumiNumber_(1), runNumber_(1), verbose_(false), createNewMemoryCounter(NULL) {}
+			MemoryCounterPimple() : eventNumber_(1), lumiNumber_(1), runNumber_(1), verbose_(false), recordModuleRetainedMemory_(false), createNewMemoryCounter(NULL), sketchAccuracy_(0.01) {}
+			~MemoryCounterPimple()
+			{
+				// The counters live on in the preloaded library, so make sure they don't call into the sampler once it's deleted
+				if( pHeapSampler_ )
+				{
+					for( auto& labelAndDetails : memoryCounters_ ) markstools::services::setAllocationObserver( labelAndDetails.second.pMemoryCounter, nullptr );
+				}
+			}
 			std::map<std::string,::ModuleDetails> memoryCounters_;
+			/// Points into memoryCounters_, indexed by ModuleDescription::id(). Null for modules that aren't being analysed.
+			std::vector<::ModuleDetails*> moduleDetailsById_;
 			size_t eventNumber_;
 			size_t lumiNumber_;
 			size_t runNumber_;
 			std::vector<std::string> modulesToAnalyse_;
 			bool verbose_;
+			bool recordModuleRetainedMemory_;
 			memcounter::IMemoryCounter* (*createNewMemoryCounter)( void );
 			std::map<memcounter::IMemoryCounter*,long int> previousRecordedSize_; // The size recorded for the previous event. Used to calculate event content size.
+			std::map<unsigned int,std::vector<::RetainedMemoryRecord> > pendingProductReleases_; ///< Records waiting for the event to be cleared, keyed by stream index
+			std::mutex productMutex_;
+			std::unique_ptr<markstools::services::HeapSampler> pHeapSampler_; ///< Null unless "heapSampleInterval" is set
+			std::string heapProfileFilename_;
+			std::string sketchFilename_; ///< Empty unless the distributions over events should be written at the end of the job
+			double sketchAccuracy_;
 		public:
-			void enableMemoryCounter( const edm::ModuleDescription& description, std::function<std::string()> methodNameFunctor );
-			void disableMemoryCounterAndPrint( const edm::ModuleDescription& description, std::function<std::string()> methodNameFunctor );
+			/// @brief Returns null if the module isn't being analysed. This is the first thing done on every transition, so keep it cheap.
+			::ModuleDetails* findModuleDetails( const edm::ModuleDescription& description ) const
+			{
+				const unsigned int id=description.id();
+				return id<moduleDetailsById_.size() ? moduleDetailsById_[id] : nullptr;
+			}
+
+			// The transition name is a string literal and pTransitionNumber points to the event, lumi or run counter (or is null).
+			// They're only formatted if the module is being analysed.
+			void enableMemoryCounter( const edm::ModuleDescription& description, const char* transitionName, const size_t* pTransitionNumber );
+			/// @brief Same as enableMemoryCounter, but also notes that the stream has an event in flight for the product records
+			void enableMemoryCounterBeforeEvent( unsigned int streamIndex, const edm::ModuleDescription& description, const char* transitionName, const size_t* pTransitionNumber );
+			void disableMemoryCounterAndPrint( const edm::ModuleDescription& description, const char* transitionName, const size_t* pTransitionNumber );
+			/// @brief Same as disableMemoryCounterAndPrint, but also keeps the size retained by the module's products until the event is cleared and fills the sketches
+			void disableMemoryCounterAfterEvent( unsigned int streamIndex, const edm::ModuleDescription& description, const char* transitionName, const size_t* pTransitionNumber );
+			/// @brief Called before the next event is read on a stream, by which time the previous event's products have been deleted
+			void releaseProducts( unsigned int streamIndex );
+			/// @brief Looks up which event products each analysed module puts, once the product registry is complete
+			void findProducts();
+			/// @brief Writes the allocated and live folded stack files, and prints the per module totals
+			void writeHeapProfile();
+			/// @brief Writes the held and peak memory sketches for every module to sketchFilename_
+			void writeSketches();
 
 
 #ifdef MEMORYCOUNTER_USE_NEW_ACTIVITYREGISTRY_SIGNALS
-			void enableMemoryCounterForStreams( edm::ModuleCallingContext const& mcc, std::function<std::string()> methodNameFunctor )
+			void enableMemoryCounterForStreams( edm::ModuleCallingContext const& mcc, const char* transitionName, const size_t* pTransitionNumber )
 			{
-				enableMemoryCounter( *mcc.moduleDescription(), methodNameFunctor );
+				enableMemoryCounter( *mcc.moduleDescription(), transitionName, pTransitionNumber );
 			}
-			void disableMemoryCounterAndPrintForStreams( edm::ModuleCallingContext const& mcc, std::function<std::string()> methodNameFunctor )
+			void disableMemoryCounterAndPrintForStreams( edm::ModuleCallingContext const& mcc, const char* transitionName, const size_t* pTransitionNumber )
 			{
-				disableMemoryCounterAndPrint( *mcc.moduleDescription(), methodNameFunctor );
+				disableMemoryCounterAndPrint( *mcc.moduleDescription(), transitionName, pTransitionNumber );
+			}
+			void enableMemoryCounterBeforeEventForStreams( edm::StreamContext const& sc, edm::ModuleCallingContext const& mcc, const char* transitionName, const size_t* pTransitionNumber )
+			{
+				enableMemoryCounterBeforeEvent( sc.streamID().value(), *mcc.moduleDescription(), transitionName, pTransitionNumber );
+			}
+			void disableMemoryCounterAfterEventForStreams( edm::StreamContext const& sc, edm::ModuleCallingContext const& mcc, const char* transitionName, const size_t* pTransitionNumber )
+			{
+				disableMemoryCounterAfterEvent( sc.streamID().value(), *mcc.moduleDescription(), transitionName, pTransitionNumber );
 			}
 #endif
 			void preModuleConstruction( const edm::ModuleDescription& description );
@@ -97,69 +183,98 @@ markstools::services::MemoryCounter::MemoryCounter( const edm::ParameterSet& par
 		else std::cout << "MemoryCounter: the parameter \"modulesToAnalyse\" has not been set, so MemoryCounter will analyse all modules" << std::endl;
 
 		if( parameterSet.exists("verbose") ) pImple_->verbose_=parameterSet.getParameter<bool>("verbose");
+		if( parameterSet.exists("recordModuleRetainedMemory") ) pImple_->recordModuleRetainedMemory_=parameterSet.getParameter<bool>("recordModuleRetainedMemory");
+		if( parameterSet.exists("heapSampleInterval") )
+		{
+			// Mean number of bytes between sampled allocations. tcmalloc uses 512KiB by default, which is cheap enough for production jobs.
+			unsigned int heapSampleInterval=parameterSet.getParameter<unsigned int>("heapSampleInterval");
+			if( heapSampleInterval>0 ) pImple_->pHeapSampler_.reset( new markstools::services::HeapSampler(heapSampleInterval) );
+			pImple_->heapProfileFilename_="heapProfile";
+			if( parameterSet.exists("heapProfileFilename") ) pImple_->heapProfileFilename_=parameterSet.getParameter<std::string>("heapProfileFilename");
+		}
+		if( parameterSet.exists("sketchFilename") ) pImple_->sketchFilename_=parameterSet.getParameter<std::string>("sketchFilename");
+		if( parameterSet.exists("sketchAccuracy") ) pImple_->sketchAccuracy_=parameterSet.getParameter<double>("sketchAccuracy");
 
 		//
 		// Register all of the watching functions
 		//
 		activityRegister.watchPreModuleConstruction( pImple_, &MemoryCounterPimple::preModuleConstruction );
-		activityRegister.watchPostModuleConstruction( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrint, pImple_, std::placeholders::_1, []{return "Construction";} ) );
+		activityRegister.watchPostModuleConstruction( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrint, pImple_, std::placeholders::_1, "Construction", nullptr ) );
 
-		activityRegister.watchPreModuleBeginJob( std::bind( &MemoryCounterPimple::enableMemoryCounter, pImple_, std::placeholders::_1, []{return "beginJob";} ) );
-		activityRegister.watchPostModuleBeginJob( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrint, pImple_, std::placeholders::_1, []{return "beginJob";} ) );
+		activityRegister.watchPreModuleBeginJob( std::bind( &MemoryCounterPimple::enableMemoryCounter, pImple_, std::placeholders::_1, "beginJob", nullptr ) );
+		activityRegister.watchPostModuleBeginJob( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrint, pImple_, std::placeholders::_1, "beginJob", nullptr ) );
 
 #ifdef MEMORYCOUNTER_USE_NEW_ACTIVITYREGISTRY_SIGNALS
-		activityRegister.watchPreModuleEvent( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, [&]{return "event"+std::to_string(pImple_->eventNumber_);} ) );
-		activityRegister.watchPostModuleEvent( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, [&]{return "event"+std::to_string(pImple_->eventNumber_);} ) );
+		activityRegister.watchPreModuleEvent( std::bind( &MemoryCounterPimple::enableMemoryCounterBeforeEventForStreams, pImple_, std::placeholders::_1, std::placeholders::_2, "event", &pImple_->eventNumber_ ) );
+		activityRegister.watchPostModuleEvent( std::bind( &MemoryCounterPimple::disableMemoryCounterAfterEventForStreams, pImple_, std::placeholders::_1, std::placeholders::_2, "event", &pImple_->eventNumber_ ) );
 		activityRegister.watchPostEvent( [&](edm::StreamContext const&){++pImple_->eventNumber_;} );
-
-		activityRegister.watchPreModuleBeginStream( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, []{return "ModuleBeginStream";} ) );
-		activityRegister.watchPostModuleBeginStream( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, []{return "ModuleBeginStream";} ) );
-		activityRegister.watchPreModuleEndStream( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, []{return "ModuleEndStream";} ) );
-		activityRegister.watchPostModuleEndStream( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, []{return "ModuleEndStream";} ) );
-
-		activityRegister.watchPreModuleStreamBeginRun( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, [&]{return "ModuleStreamBeginRun"+std::to_string(pImple_->runNumber_);} ) );
-		activityRegister.watchPostModuleStreamBeginRun( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, [&]{return "ModuleStreamBeginRun"+std::to_string(pImple_->runNumber_);} ) );
-		activityRegister.watchPreModuleStreamEndRun( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, [&]{return "ModuleStreamEndRun"+std::to_string(pImple_->runNumber_);} ) );
-		activityRegister.watchPostModuleStreamEndRun( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, [&]{return "ModuleStreamEndRun"+std::to_string(pImple_->runNumber_);} ) );
-
-		activityRegister.watchPreModuleStreamBeginLumi( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, [&]{return "ModuleStreamBeginLumi"+std::to_string(pImple_->lumiNumber_);} ) );
-		activityRegister.watchPostModuleStreamBeginLumi( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, [&]{return "ModuleStreamBeginLumi"+std::to_string(pImple_->lumiNumber_);} ) );
-		activityRegister.watchPreModuleStreamEndLumi( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, [&]{return "ModuleStreamEndLumi"+std::to_string(pImple_->lumiNumber_);} ) );
-		activityRegister.watchPostModuleStreamEndLumi( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, [&]{return "ModuleStreamEndLumi"+std::to_string(pImple_->lumiNumber_);} ) );
-
-		activityRegister.watchPreModuleGlobalBeginRun( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, [&]{return "ModuleGlobalBeginRun"+std::to_string(pImple_->runNumber_);} ) );
-		activityRegister.watchPostModuleGlobalBeginRun( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, [&]{return "ModuleGlobalBeginRun"+std::to_string(pImple_->runNumber_);} ) );
-		activityRegister.watchPreModuleGlobalEndRun( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, [&]{return "ModuleGlobalEndRun"+std::to_string(pImple_->runNumber_);} ) );
-		activityRegister.watchPostModuleGlobalEndRun( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, [&]{return "ModuleGlobalEndRun"+std::to_string(pImple_->runNumber_);} ) );
-
-		activityRegister.watchPreModuleGlobalBeginLumi( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, [&]{return "ModuleGlobalBeginLumi"+std::to_string(pImple_->lumiNumber_);} ) );
-		activityRegister.watchPostModuleGlobalBeginLumi( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, [&]{return "ModuleGlobalBeginLumi"+std::to_string(pImple_->lumiNumber_);} ) );
-		activityRegister.watchPreModuleGlobalEndLumi( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, [&]{return "ModuleGlobalEndLumi"+std::to_string(pImple_->lumiNumber_);} ) );
-		activityRegister.watchPostModuleGlobalEndLumi( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, [&]{return "ModuleGlobalEndLumi"+std::to_string(pImple_->lumiNumber_);} ) );
+		// The event principal is cleared after postEvent, so the earliest point the product memory
+		// is guaranteed to have been released is when the next event is read on the same stream.
+		if( pImple_->recordModuleRetainedMemory_ ) activityRegister.watchPreSourceEvent( [&](edm::StreamID streamID){pImple_->releaseProducts(streamID.value());} );
+
+		activityRegister.watchPreModuleBeginStream( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, "ModuleBeginStream", nullptr ) );
+		activityRegister.watchPostModuleBeginStream( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, "ModuleBeginStream", nullptr ) );
+		activityRegister.watchPreModuleEndStream( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, "ModuleEndStream", nullptr ) );
+		activityRegister.watchPostModuleEndStream( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, "ModuleEndStream", nullptr ) );
+
+		activityRegister.watchPreModuleStreamBeginRun( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, "ModuleStreamBeginRun", &pImple_->runNumber_ ) );
+		activityRegister.watchPostModuleStreamBeginRun( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, "ModuleStreamBeginRun", &pImple_->runNumber_ ) );
+		activityRegister.watchPreModuleStreamEndRun( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, "ModuleStreamEndRun", &pImple_->runNumber_ ) );
+		activityRegister.watchPostModuleStreamEndRun( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, "ModuleStreamEndRun", &pImple_->runNumber_ ) );
+
+		activityRegister.watchPreModuleStreamBeginLumi( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, "ModuleStreamBeginLumi", &pImple_->lumiNumber_ ) );
+		activityRegister.watchPostModuleStreamBeginLumi( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, "ModuleStreamBeginLumi", &pImple_->lumiNumber_ ) );
+		activityRegister.watchPreModuleStreamEndLumi( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, "ModuleStreamEndLumi", &pImple_->lumiNumber_ ) );
+		activityRegister.watchPostModuleStreamEndLumi( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, "ModuleStreamEndLumi", &pImple_->lumiNumber_ ) );
+
+		activityRegister.watchPreModuleGlobalBeginRun( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, "ModuleGlobalBeginRun", &pImple_->runNumber_ ) );
+		activityRegister.watchPostModuleGlobalBeginRun( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, "ModuleGlobalBeginRun", &pImple_->runNumber_ ) );
+		activityRegister.watchPreModuleGlobalEndRun( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, "ModuleGlobalEndRun", &pImple_->runNumber_ ) );
+		activityRegister.watchPostModuleGlobalEndRun( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, "ModuleGlobalEndRun", &pImple_->runNumber_ ) );
+
+		activityRegister.watchPreModuleGlobalBeginLumi( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, "ModuleGlobalBeginLumi", &pImple_->lumiNumber_ ) );
+		activityRegister.watchPostModuleGlobalBeginLumi( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, "ModuleGlobalBeginLumi", &pImple_->lumiNumber_ ) );
+		activityRegister.watchPreModuleGlobalEndLumi( std::bind( &MemoryCounterPimple::enableMemoryCounterForStreams, pImple_, std::placeholders::_2, "ModuleGlobalEndLumi", &pImple_->lumiNumber_ ) );
+		activityRegister.watchPostModuleGlobalEndLumi( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrintForStreams, pImple_, std::placeholders::_2, "ModuleGlobalEndLumi", &pImple_->lumiNumber_ ) );
 
 		activityRegister.watchPostGlobalEndRun( [&](edm::GlobalContext const&){++pImple_->runNumber_;} );
 		activityRegister.watchPostGlobalEndLumi( [&](edm::GlobalContext const&){++pImple_->lumiNumber_;} );
 #else
-		activityRegister.watchPreModuleBeginRun( std::bind( &MemoryCounterPimple::enableMemoryCounter, pImple_, std::placeholders::_1, [&]{return "beginRun"+std::to_string(pImple_->runNumber_);} ) );
-		activityRegister.watchPostModuleBeginRun( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrint, pImple_, std::placeholders::_1, [&]{return "beginRun"+std::to_string(pImple_->runNumber_);} ) );
+		activityRegister.watchPreModuleBeginRun( std::bind( &MemoryCounterPimple::enableMemoryCounter, pImple_, std::placeholders::_1, "beginRun", &pImple_->runNumber_ ) );
+		activityRegister.watchPostModuleBeginRun( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrint, pImple_, std::placeholders::_1, "beginRun", &pImple_->runNumber_ ) );
 
-		activityRegister.watchPreModuleBeginLumi( std::bind( &MemoryCounterPimple::enableMemoryCounter, pImple_, std::placeholders::_1, [&]{return "beginLumi"+std::to_string(pImple_->lumiNumber_);} ) );
-		activityRegister.watchPostModuleBeginLumi( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrint, pImple_, std::placeholders::_1, [&]{return "beginLumi"+std::to_string(pImple_->lumiNumber_);} ) );
+		activityRegister.watchPreModuleBeginLumi( std::bind( &MemoryCounterPimple::enableMemoryCounter, pImple_, std::placeholders::_1, "beginLumi", &pImple_->lumiNumber_ ) );
+		activityRegister.watchPostModuleBeginLumi( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrint, pImple_, std::placeholders::_1, "beginLumi", &pImple_->lumiNumber_ ) );
 
-		activityRegister.watchPreModule( std::bind( &MemoryCounterPimple::enableMemoryCounter, pImple_, std::placeholders::_1, [&]{return "event"+std::to_string(pImple_->eventNumber_);} ) );
-		activityRegister.watchPostModule( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrint, pImple_, std::placeholders::_1, [&]{return "event"+std::to_string(pImple_->eventNumber_);} ) );
+		activityRegister.watchPreModule( std::bind( &MemoryCounterPimple::enableMemoryCounterBeforeEvent, pImple_, 0, std::placeholders::_1, "event", &pImple_->eventNumber_ ) );
+		activityRegister.watchPostModule( std::bind( &MemoryCounterPimple::disableMemoryCounterAfterEvent, pImple_, 0, std::placeholders::_1, "event", &pImple_->eventNumber_ ) );
 		activityRegister.watchPostProcessEvent( [&](const edm::Event&,const edm::EventSetup&){++pImple_->eventNumber_;} );
+		if( pImple_->recordModuleRetainedMemory_ ) activityRegister.watchPreSource( [&]{pImple_->releaseProducts(0);} );
 
-		activityRegister.watchPreModuleEndLumi( std::bind( &MemoryCounterPimple::enableMemoryCounter, pImple_, std::placeholders::_1, [&]{return "endLumi"+std::to_string(pImple_->lumiNumber_);} ) );
-		activityRegister.watchPostModuleEndLumi( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrint, pImple_, std::placeholders::_1, [&]{return "endLumi"+std::to_string(pImple_->lumiNumber_);} ) );
+		activityRegister.watchPreModuleEndLumi( std::bind( &MemoryCounterPimple::enableMemoryCounter, pImple_, std::placeholders::_1, "endLumi", &pImple_->lumiNumber_ ) );
+		activityRegister.watchPostModuleEndLumi( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrint, pImple_, std::placeholders::_1, "endLumi", &pImple_->lumiNumber_ ) );
 		activityRegister.watchPostEndLumi( [&](edm::LuminosityBlock const&, edm::EventSetup const&){++pImple_->lumiNumber_;} );
 
-		activityRegister.watchPreModuleEndRun( std::bind( &MemoryCounterPimple::enableMemoryCounter, pImple_, std::placeholders::_1, [&]{return "endRun"+std::to_string(pImple_->runNumber_);} ) );
-		activityRegister.watchPostModuleEndRun( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrint, pImple_, std::placeholders::_1, [&]{return "endRun"+std::to_string(pImple_->runNumber_);} ) );
+		activityRegister.watchPreModuleEndRun( std::bind( &MemoryCounterPimple::enableMemoryCounter, pImple_, std::placeholders::_1, "endRun", &pImple_->runNumber_ ) );
+		activityRegister.watchPostModuleEndRun( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrint, pImple_, std::placeholders::_1, "endRun", &pImple_->runNumber_ ) );
 		activityRegister.watchPostEndRun( [&](edm::Run const&, edm::EventSetup const&){++pImple_->runNumber_;} );
 #endif
-		activityRegister.watchPreModuleEndJob( std::bind( &MemoryCounterPimple::enableMemoryCounter, pImple_, std::placeholders::_1, []{return "endJob";} ) );
-		activityRegister.watchPostModuleEndJob( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrint, pImple_, std::placeholders::_1, []{return "endJob";} ) );
+		activityRegister.watchPreModuleEndJob( std::bind( &MemoryCounterPimple::enableMemoryCounter, pImple_, std::placeholders::_1, "endJob", nullptr ) );
+		activityRegister.watchPostModuleEndJob( std::bind( &MemoryCounterPimple::disableMemoryCounterAndPrint, pImple_, std::placeholders::_1, "endJob", nullptr ) );
+
+		if( pImple_->pHeapSampler_ ) activityRegister.watchPostEndJob( std::bind( &MemoryCounterPimple::writeHeapProfile, pImple_ ) );
+		if( !pImple_->sketchFilename_.empty() ) activityRegister.watchPostEndJob( std::bind( &MemoryCounterPimple::writeSketches, pImple_ ) );
+
+		if( pImple_->recordModuleRetainedMemory_ )
+		{
+			activityRegister.watchPostBeginJob( std::bind( &MemoryCounterPimple::findProducts, pImple_ ) );
+			// Anything still pending belongs to the last event on each stream, which has been cleared by now
+			activityRegister.watchPostEndJob( [&]{
+				std::vector<unsigned int> streams;
+				for( const auto& streamRecords : pImple_->pendingProductReleases_ ) streams.push_back( streamRecords.first );
+				for( const auto streamIndex : streams ) pImple_->releaseProducts( streamIndex );
+			} );
+		}
 	}
 	else
 	{
@@ -175,40 +290,52 @@ markstools::services::MemoryCounter::~MemoryCounter()
 	delete pImple_;
 }
 
-void markstools::services::MemoryCounterPimple::enableMemoryCounter( const edm::ModuleDescription& description, std::function<std::string()> methodNameFunctor )
+void markstools::services::MemoryCounterPimple::enableMemoryCounter( const edm::ModuleDescription& description, const char* transitionName, const size_t* pTransitionNumber )
 {
-	const std::string& methodName=methodNameFunctor();
-
-	auto iModuleDetails=memoryCounters_.find( description.moduleLabel() );
-	if( iModuleDetails!=memoryCounters_.end() )
+	::ModuleDetails* pModuleDetails=findModuleDetails( description );
+	if( pModuleDetails )
 	{
-		iModuleDetails->second.pMemoryCounter->resetMaximum();
-		if( iModuleDetails->second.previousRecordedSize!=-1 ) iModuleDetails->second.previousRecordedSize-=iModuleDetails->second.pMemoryCounter->currentSize();
-		iModuleDetails->second.pMemoryCounter->enable();
+		pModuleDetails->pMemoryCounter->resetMaximum();
+		pModuleDetails->sizeAtEnable=pModuleDetails->pMemoryCounter->currentSize();
+		if( pModuleDetails->previousRecordedSize!=-1 ) pModuleDetails->previousRecordedSize-=pModuleDetails->sizeAtEnable;
+		pModuleDetails->pMemoryCounter->enable();
 
-		if( verbose_ ) std::cout << "Enabling MemCounter for module \"" << description.moduleLabel() << "\" in method " << methodName << "." << std::endl;
+		if( verbose_ ) std::cout << "Enabling MemCounter for module \"" << description.moduleLabel() << "\" in method " << TransitionName(transitionName,pTransitionNumber) << "." << std::endl;
 	}
 }
 
-void markstools::services::MemoryCounterPimple::disableMemoryCounterAndPrint( const edm::ModuleDescription& description, std::function<std::string()> methodNameFunctor )
+void markstools::services::MemoryCounterPimple::enableMemoryCounterBeforeEvent( unsigned int streamIndex, const edm::ModuleDescription& description, const char* transitionName, const size_t* pTransitionNumber )
 {
-	const std::string& methodName=methodNameFunctor();
+	::ModuleDetails* pModuleDetails=findModuleDetails( description );
+	if( pModuleDetails && recordModuleRetainedMemory_ && !pModuleDetails->products.empty() )
+	{
+		std::lock_guard<std::mutex> lock( productMutex_ );
+		// Starting a call changes the counter, so anything already in flight on another stream is disturbed
+		if( pModuleDetails->eventsInFlight++>0 ) ++pModuleDetails->disturbances;
+		if( pModuleDetails->disturbancesAtStartByStream.size()<=streamIndex ) pModuleDetails->disturbancesAtStartByStream.resize( streamIndex+1, 0 );
+		pModuleDetails->disturbancesAtStartByStream[streamIndex]=pModuleDetails->disturbances;
+	}
+	enableMemoryCounter( description, transitionName, pTransitionNumber );
+}
 
-	auto iModuleDetails=memoryCounters_.find( description.moduleLabel() );
-	if( iModuleDetails!=memoryCounters_.end() )
+void markstools::services::MemoryCounterPimple::disableMemoryCounterAndPrint( const edm::ModuleDescription& description, const char* transitionName, const size_t* pTransitionNumber )
+{
+	::ModuleDetails* pModuleDetails=findModuleDetails( description );
+	if( pModuleDetails )
 	{
-		memcounter::IMemoryCounter* pMemoryCounter=iModuleDetails->second.pMemoryCounter;
+		memcounter::IMemoryCounter* pMemoryCounter=pModuleDetails->pMemoryCounter;
 		pMemoryCounter->disable();
 
-		std::cout << " *MEMCOUNTER* " << methodName << "," << description.moduleLabel() << "," << description.moduleName()
+		TransitionName transition( transitionName, pTransitionNumber );
+		std::cout << " *MEMCOUNTER* " << transition << "," << description.moduleLabel() << "," << description.moduleName()
 				<< "," << pMemoryCounter->currentSize() << "," << pMemoryCounter->maximumSize()
 				<< "," << pMemoryCounter->currentNumberOfAllocations() << "," << pMemoryCounter->maximumNumberOfAllocations();
-		if( iModuleDetails->second.previousRecordedSize!=-1 ) std::cout << "," << iModuleDetails->second.previousEvent
-				<< "," << iModuleDetails->second.previousRecordedSize;
+		if( pModuleDetails->previousRecordedSize!=-1 ) std::cout << "," << pModuleDetails->previousEvent
+				<< "," << pModuleDetails->previousRecordedSize;
 		std::cout << std::endl;
 
-		iModuleDetails->second.previousRecordedSize=pMemoryCounter->currentSize();
-		iModuleDetails->second.previousEvent=methodName;
+		pModuleDetails->previousRecordedSize=pMemoryCounter->currentSize();
+		pModuleDetails->previousEvent=transition;
 	}
 }
 
@@ -220,7 +347,14 @@ void markstools::services::MemoryCounterPimple::preModuleConstruction( const edm
 		memcounter::IMemoryCounter* pMemoryCounter=createNewMemoryCounter();
 		if( pMemoryCounter )
 		{
-			memoryCounters_.insert( std::make_pair(description.moduleLabel(),::ModuleDetails(pMemoryCounter)) );
+			auto insertResult=memoryCounters_.insert( std::make_pair(description.moduleLabel(),::ModuleDetails(pMemoryCounter,description.moduleName(),sketchAccuracy_)) );
+			if( moduleDetailsById_.size()<=description.id() ) moduleDetailsById_.resize( description.id()+1, nullptr );
+			moduleDetailsById_[description.id()]=&insertResult.first->second;
+			if( pHeapSampler_ && !markstools::services::setAllocationObserver( pMemoryCounter, pHeapSampler_->observerForModule(description.moduleLabel(),description.moduleName()) ) )
+			{
+				std::cerr << " *** MemoryCounter: the preloaded library doesn't export setMemoryCounterAllocationObserver_v1, so heap sampling is switched off. heapSampleInterval needs a MemCounter patched to support allocation observers, see interface/AllocationObserver.h." << std::endl;
+				pHeapSampler_.reset();
+			}
 			if( verbose_ ) std::cout << "Enabling MemCounter for module \"" << description.moduleLabel() << "\" of type \"" << description.moduleName() << "\"." << std::endl;
 			pMemoryCounter->resetMaximum();
 			pMemoryCounter->enable();
@@ -229,3 +363,105 @@ void markstools::services::MemoryCounterPimple::preModuleConstruction( const edm
 	}
 	else std::cout << "MemCounter not enabled for module \"" << description.moduleLabel() << "\"." << std::endl;
 }
+
+void markstools::services::MemoryCounterPimple::disableMemoryCounterAfterEvent( unsigned int streamIndex, const edm::ModuleDescription& description, const char* transitionName, const size_t* pTransitionNumber )
+{
+	::ModuleDetails* pModuleDetails=findModuleDetails( description );
+	if( !pModuleDetails ) return;
+
+	// Take a copy of the event number now, in case another stream finishes its event before the products are released
+	TransitionName transition( transitionName, pTransitionNumber );
+	disableMemoryCounterAndPrint( description, transitionName, pTransitionNumber );
+
+	// The counter is disabled by now, so none of the bookkeeping below gets attributed to the module
+	if( !sketchFilename_.empty() )
+	{
+		long int heldSize=pModuleDetails->pMemoryCounter->currentSize();
+		long int peakSize=pModuleDetails->pMemoryCounter->maximumSize();
+		std::lock_guard<std::mutex> lock( *pModuleDetails->pSketchMutex );
+		pModuleDetails->heldSketch.add( heldSize );
+		pModuleDetails->peakSketch.add( peakSize );
+	}
+
+	if( !recordModuleRetainedMemory_ || pModuleDetails->products.empty() ) return;
+
+	long int sizeAfterModule=pModuleDetails->pMemoryCounter->currentSize();
+	std::lock_guard<std::mutex> lock( productMutex_ );
+	unsigned long disturbancesAtStart=( streamIndex<pModuleDetails->disturbancesAtStartByStream.size() ? pModuleDetails->disturbancesAtStartByStream[streamIndex] : 0 );
+	pendingProductReleases_[streamIndex].push_back( ::RetainedMemoryRecord{ &description.moduleLabel(), &description.moduleName(),
+			pModuleDetails, transition, sizeAfterModule-pModuleDetails->sizeAtEnable, sizeAfterModule, disturbancesAtStart } );
+}
+
+void markstools::services::MemoryCounterPimple::releaseProducts( unsigned int streamIndex )
+{
+	std::lock_guard<std::mutex> lock( productMutex_ );
+	auto iStreamRecords=pendingProductReleases_.find( streamIndex );
+	if( iStreamRecords==pendingProductReleases_.end() ) return;
+
+	// A module's counter is shared between streams, so if the module ran or had its products released on
+	// another stream while this record was in flight the sizes include that stream's changes as well. Those
+	// records are flagged rather than dropped, so that it's clear how many there were.
+	for( const auto& record : iStreamRecords->second )
+	{
+		::ModuleDetails& moduleDetails=*record.pModuleDetails;
+		long int releasedSize=record.sizeAfterModule-moduleDetails.pMemoryCounter->currentSize();
+		bool undisturbed=( moduleDetails.disturbances==record.disturbancesAtStart );
+		// This release changes the counter, so anything else still in flight is disturbed
+		if( moduleDetails.eventsInFlight>0 && --moduleDetails.eventsInFlight>0 ) ++moduleDetails.disturbances;
+
+		std::cout << " *MODULERETAINED* " << record.event << "," << *record.pModuleLabel << "," << *record.pModuleName
+				<< "," << record.retainedSize << "," << releasedSize << "," << ( undisturbed ? 1 : 0 ) << "," << moduleDetails.products << std::endl;
+	}
+	iStreamRecords->second.clear();
+}
+
+void markstools::services::MemoryCounterPimple::findProducts()
+{
+	edm::Service<edm::ConstProductRegistry> productRegistry;
+	for( const auto& keyAndDescription : productRegistry->productList() )
+	{
+		const edm::BranchDescription& branch=keyAndDescription.second;
+		if( !branch.produced() || branch.branchType()!=edm::InEvent ) continue;
+
+		auto iModuleDetails=memoryCounters_.find( branch.moduleLabel() );
+		if( iModuleDetails==memoryCounters_.end() ) continue;
+
+		std::string& products=iModuleDetails->second.products;
+		if( !products.empty() ) products+=";";
+		products+=branch.friendlyClassName()+"_"+branch.moduleLabel()+"_"+branch.productInstanceName();
+		if( verbose_ ) std::cout << "MemoryCounter: module \"" << branch.moduleLabel() << "\" puts product " << branch.friendlyClassName() << "_" << branch.moduleLabel() << "_" << branch.productInstanceName() << std::endl;
+	}
+}
+
+void markstools::services::MemoryCounterPimple::writeHeapProfile()
+{
+	if( !pHeapSampler_ ) return; // Might have been switched off if the preloaded library is too old
+
+	std::ofstream allocatedFile( heapProfileFilename_+"_allocated.folded" );
+	pHeapSampler_->writeFoldedStacks( allocatedFile, false );
+	std::ofstream liveFile( heapProfileFilename_+"_live.folded" );
+	pHeapSampler_->writeFoldedStacks( liveFile, true );
+	pHeapSampler_->printSummary( std::cout );
+}
+
+void markstools::services::MemoryCounterPimple::writeSketches()
+{
+	std::ofstream outputFile( sketchFilename_ );
+	if( !outputFile.is_open() )
+	{
+		std::cerr << " *** MemoryCounter: unable to open \"" << sketchFilename_ << "\" to write the sketches" << std::endl;
+		return;
+	}
+
+	// Same format as ModuleTimer's sketch files, so that mergeBenchmarkSketches can take both. This is after
+	// the last event, so nothing else is filling the sketches.
+	outputFile << "# moduleLabel moduleType metric sketch" << "\n";
+	for( const auto& labelAndDetails : memoryCounters_ )
+	{
+		outputFile << labelAndDetails.first << " " << labelAndDetails.second.moduleName << " held ";
+		labelAndDetails.second.heldSketch.write( outputFile );
+		outputFile << "\n" << labelAndDetails.first << " " << labelAndDetails.second.moduleName << " peak ";
+		labelAndDetails.second.peakSketch.write( outputFile );
+		outputFile << "\n";
+	}
+}
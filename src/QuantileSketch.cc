@@ -0,0 +1,164 @@
+#include "MarksTools/Benchmarking/interface/QuantileSketch.h"
+
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <iostream>
+#include <algorithm>
+
+//
+// Unnamed namespace for things only used in this file
+//
+namespace
+{
+	/// Far more than any sketch needs (see the class description), but small enough that a corrupt file can't make read allocate gigabytes
+	const size_t largestReadableMaximumBins=1<<20;
+
+} // end of the unnamed namespace
+
+markstools::services::QuantileSketch::QuantileSketch( double relativeAccuracy, size_t maximumBins )
+	: relativeAccuracy_(relativeAccuracy), logGamma_( std::log( (1+relativeAccuracy)/(1-relativeAccuracy) ) ), maximumBins_(maximumBins),
+	  count_(0), zeroCount_(0), sum_(0), minimum_( std::numeric_limits<double>::infinity() ), maximum_( -std::numeric_limits<double>::infinity() ),
+	  firstKey_(0)
+{
+	if( relativeAccuracy<=0 || relativeAccuracy>=1 ) throw std::runtime_error( "QuantileSketch relative accuracy must be between 0 and 1" );
+	if( maximumBins<2 ) throw std::runtime_error( "QuantileSketch needs at least two bins" );
+}
+
+int markstools::services::QuantileSketch::key( double value ) const
+{
+	return static_cast<int>( std::ceil( std::log(value)/logGamma_ ) );
+}
+
+double markstools::services::QuantileSketch::valueForKey( int key ) const
+{
+	// The middle of the bin in the relative sense, so that the error is the same either side
+	double gamma=std::exp(logGamma_);
+	return 2*std::exp(key*logGamma_)/(gamma+1);
+}
+
+void markstools::services::QuantileSketch::collapseLowestBins()
+{
+	if( binCounts_.size()<=maximumBins_ ) return;
+
+	size_t binsToCollapse=binCounts_.size()-maximumBins_;
+	uint64_t collapsedCount=0;
+	for( size_t index=0; index<=binsToCollapse; ++index ) collapsedCount+=binCounts_[index];
+	binCounts_.erase( binCounts_.begin(), binCounts_.begin()+binsToCollapse );
+	binCounts_.front()=collapsedCount;
+	firstKey_+=binsToCollapse;
+}
+
+void markstools::services::QuantileSketch::add( double value )
+{
+	++count_;
+	sum_+=value;
+	minimum_=std::min( minimum_, value );
+	maximum_=std::max( maximum_, value );
+
+	if( value<=minimumValue() )
+	{
+		++zeroCount_;
+		return;
+	}
+
+	int newKey=key(value);
+	if( binCounts_.empty() )
+	{
+		firstKey_=newKey;
+		binCounts_.push_back( 0 );
+	}
+	else if( newKey<firstKey_ )
+	{
+		binCounts_.insert( binCounts_.begin(), firstKey_-newKey, 0 );
+		firstKey_=newKey;
+	}
+	else if( newKey>=firstKey_+static_cast<int>(binCounts_.size()) ) binCounts_.resize( newKey-firstKey_+1, 0 );
+	++binCounts_[newKey-firstKey_];
+
+	collapseLowestBins();
+}
+
+void markstools::services::QuantileSketch::merge( const QuantileSketch& otherSketch )
+{
+	if( std::fabs(otherSketch.relativeAccuracy_-relativeAccuracy_)>1e-12 ) throw std::runtime_error( "Can't merge QuantileSketches with different accuracies" );
+	if( otherSketch.count_==0 ) return;
+
+	count_+=otherSketch.count_;
+	zeroCount_+=otherSketch.zeroCount_;
+	sum_+=otherSketch.sum_;
+	minimum_=std::min( minimum_, otherSketch.minimum_ );
+	maximum_=std::max( maximum_, otherSketch.maximum_ );
+	if( otherSketch.binCounts_.empty() ) return;
+
+	if( binCounts_.empty() )
+	{
+		firstKey_=otherSketch.firstKey_;
+		binCounts_=otherSketch.binCounts_;
+	}
+	else
+	{
+		int newFirstKey=std::min( firstKey_, otherSketch.firstKey_ );
+		int newLastKey=std::max( firstKey_+static_cast<int>(binCounts_.size()), otherSketch.firstKey_+static_cast<int>(otherSketch.binCounts_.size()) );
+		if( newFirstKey<firstKey_ ) binCounts_.insert( binCounts_.begin(), firstKey_-newFirstKey, 0 );
+		firstKey_=newFirstKey;
+		binCounts_.resize( newLastKey-firstKey_, 0 );
+		for( size_t index=0; index<otherSketch.binCounts_.size(); ++index ) binCounts_[otherSketch.firstKey_-firstKey_+index]+=otherSketch.binCounts_[index];
+	}
+
+	collapseLowestBins();
+}
+
+double markstools::services::QuantileSketch::quantile( double fraction ) const
+{
+	if( count_==0 ) return 0;
+	if( fraction<=0 ) return minimum_;
+	if( fraction>=1 ) return maximum_;
+
+	uint64_t rank=static_cast<uint64_t>( fraction*(count_-1) );
+	if( rank<zeroCount_ ) return std::max( minimum_, 0.0 );
+
+	uint64_t cumulativeCount=zeroCount_;
+	for( size_t index=0; index<binCounts_.size(); ++index )
+	{
+		cumulativeCount+=binCounts_[index];
+		if( cumulativeCount>rank ) return std::max( minimum_, std::min( maximum_, valueForKey(firstKey_+index) ) );
+	}
+	return maximum_;
+}
+
+void markstools::services::QuantileSketch::write( std::ostream& output ) const
+{
+	// Store the bins as a dense run from the first key, since zero counts are only one character each
+	std::streamsize oldPrecision=output.precision( std::numeric_limits<double>::max_digits10 );
+	output << relativeAccuracy_ << " " << maximumBins_ << " " << count_ << " " << zeroCount_ << " " << sum_
+			<< " " << ( count_>0 ? minimum_ : 0 ) << " " << ( count_>0 ? maximum_ : 0 ) << " " << firstKey_ << " " << binCounts_.size();
+	for( const auto binCount : binCounts_ ) output << " " << binCount;
+	output.precision( oldPrecision );
+}
+
+markstools::services::QuantileSketch markstools::services::QuantileSketch::read( std::istream& input )
+{
+	double relativeAccuracy;
+	size_t maximumBins;
+	input >> relativeAccuracy >> maximumBins;
+	if( input.fail() ) throw std::runtime_error( "Unable to read the QuantileSketch parameters" );
+	if( maximumBins>::largestReadableMaximumBins ) throw std::runtime_error( "QuantileSketch maximum number of bins is too large, the input is probably corrupt" );
+
+	QuantileSketch sketch( relativeAccuracy, maximumBins );
+	size_t numberOfBins;
+	input >> sketch.count_ >> sketch.zeroCount_ >> sketch.sum_ >> sketch.minimum_ >> sketch.maximum_ >> sketch.firstKey_ >> numberOfBins;
+	if( input.fail() ) throw std::runtime_error( "Unable to read the QuantileSketch header" );
+	// Sketches never have more bins than their maximum, so anything else isn't something written by write
+	if( numberOfBins>maximumBins ) throw std::runtime_error( "QuantileSketch has more bins than its maximum, the input is probably corrupt" );
+	if( sketch.count_==0 )
+	{
+		sketch.minimum_=std::numeric_limits<double>::infinity();
+		sketch.maximum_=-std::numeric_limits<double>::infinity();
+	}
+
+	sketch.binCounts_.resize( numberOfBins );
+	for( auto& binCount : sketch.binCounts_ ) input >> binCount;
+	if( input.fail() ) throw std::runtime_error( "Unable to read the QuantileSketch bins" );
+	return sketch;
+}
@@ -0,0 +1,65 @@
+#include "MarksTools/Benchmarking/interface/StackWalk.h"
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <cerrno>
+#include <cstdint>
+
+//
+// Unnamed namespace for things only used in this file
+//
+namespace
+{
+	/// A frame bigger than this is taken to mean the chain has gone through a function without a frame pointer
+	const uintptr_t maximumFrameBytes=1<<20;
+	const uintptr_t pageMask=~static_cast<uintptr_t>(4095);
+
+	/** @brief Whether the word at address can be read, without any chance of a fault.
+	 *
+	 * The kernel copies the new signal mask from the pointer before it rejects the invalid "how" argument, so
+	 * EFAULT means the memory isn't readable and anything else means it is. Nothing is changed either way. */
+	bool isReadable( const void* address )
+	{
+		int savedErrno=errno; // This is called from signal handlers, which mustn't change errno
+		long result=syscall( SYS_rt_sigprocmask, ~0, address, nullptr, 8 );
+		bool readable=!( result<0 && errno==EFAULT );
+		errno=savedErrno;
+		return readable;
+	}
+
+} // end of the unnamed namespace
+
+int markstools::services::walkFramePointers( void* programCounter, void* framePointer, void** frames, int maximumDepth )
+{
+	int depth=0;
+	if( programCounter!=nullptr && depth<maximumDepth ) frames[depth++]=programCounter;
+
+	// On both x86-64 and AArch64 the frame pointer points at the caller's frame pointer, followed by the return address
+	const uintptr_t* pFrame=static_cast<const uintptr_t*>( framePointer );
+	uintptr_t readablePage=0; // The last page checked, so that most frames don't need the system call
+	while( depth<maximumDepth && pFrame!=nullptr )
+	{
+		if( reinterpret_cast<uintptr_t>(pFrame)%sizeof(uintptr_t)!=0 ) break;
+		for( int word=0; word<2; ++word )
+		{
+			uintptr_t page=reinterpret_cast<uintptr_t>(pFrame+word) & ::pageMask;
+			if( page==readablePage ) continue;
+			if( !::isReadable( pFrame+word ) ) return depth;
+			readablePage=page;
+		}
+
+		const uintptr_t* pNextFrame=reinterpret_cast<const uintptr_t*>( pFrame[0] );
+		if( pFrame[1]==0 ) break;
+		frames[depth++]=reinterpret_cast<void*>( pFrame[1] );
+		// The stack grows down, so the callers' frames are always at higher addresses
+		if( pNextFrame<=pFrame || reinterpret_cast<uintptr_t>(pNextFrame)-reinterpret_cast<uintptr_t>(pFrame)>::maximumFrameBytes ) break;
+		pFrame=pNextFrame;
+	}
+	return depth;
+}
+
+__attribute__((noinline)) int markstools::services::walkFramePointersFromHere( void** frames, int maximumDepth )
+{
+	// The return address in this function's own frame record is the caller's, so nothing needs skipping
+	return walkFramePointers( nullptr, __builtin_frame_address(0), frames, maximumDepth );
+}
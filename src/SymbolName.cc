@@ -0,0 +1,30 @@
+#include "MarksTools/Benchmarking/interface/SymbolName.h"
+
+#include <dlfcn.h>
+#include <cxxabi.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+
+std::string markstools::services::symbolName( void* address )
+{
+	Dl_info info;
+	if( dladdr( address, &info ) && info.dli_sname )
+	{
+		int status=0;
+		char* demangled=abi::__cxa_demangle( info.dli_sname, nullptr, nullptr, &status );
+		std::string name( status==0 && demangled ? demangled : info.dli_sname );
+		std::free( demangled );
+		return name;
+	}
+	else if( dladdr( address, &info ) && info.dli_fname )
+	{
+		char offset[32];
+		snprintf( offset, sizeof(offset), "+0x%lx", static_cast<unsigned long>( reinterpret_cast<uintptr_t>(address)-reinterpret_cast<uintptr_t>(info.dli_fbase) ) );
+		std::string library( info.dli_fname );
+		return library.substr( library.find_last_of('/')+1 )+offset;
+	}
+	char name[32];
+	snprintf( name, sizeof(name), "0x%lx", static_cast<unsigned long>( reinterpret_cast<uintptr_t>(address) ) );
+	return name;
+}
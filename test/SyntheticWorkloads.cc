@@ -0,0 +1,178 @@
+/** @file
+ * @brief Analysers with known, fixed behaviour, for checking what ModuleTimer, MemoryCounter and CheckRSSService report.
+ *
+ * None of these read anything from the event, so they can be run on an EmptySource with any number of threads.
+ * scripts/validateBenchmarks.py builds configurations out of these and compares the services' output with the
+ * parameters they were given.
+ *
+ * - SyntheticCpuBurn: spins until the thread has used cpuSeconds of CPU each event
+ * - SyntheticSleep: sleeps for sleepSeconds each event, so uses real time but next to no CPU
+ * - SyntheticAllocationChurn: allocates allocationsPerEvent blocks of allocationSize bytes, touches them, then frees them all
+ * - SyntheticLeak: allocates bytesPerEvent each event and keeps it for holdForEvents events (0 means forever)
+ * - SyntheticSpike: every spikeInterval events allocates and touches spikeBytes, then frees it before returning
+ *
+ * @author Mark Grimes (mark.grimes@bristol.ac.uk)
+ * @date 19/Oct/2026
+ */
+#include "FWCore/Framework/interface/MakerMacros.h"
+#include "FWCore/ParameterSet/interface/ParameterSet.h"
+#include "FWCore/ServiceRegistry/interface/ActivityRegistry.h"
+
+// The same check as in the services for whether this is a threaded CMSSW. If it is, use stream
+// modules so that several copies can run at once, otherwise the legacy EDAnalyzer.
+#ifdef AR_WATCH_USING_METHOD_3
+#	include "FWCore/Framework/interface/stream/EDAnalyzer.h"
+#else
+#	include "FWCore/Framework/interface/EDAnalyzer.h"
+#endif
+
+#include <time.h>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+#include <thread>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+//
+// Use the unnamed namespace for things only used in this file
+//
+namespace
+{
+#ifdef AR_WATCH_USING_METHOD_3
+	typedef edm::stream::EDAnalyzer<> AnalyzerBase;
+#else
+	typedef edm::EDAnalyzer AnalyzerBase;
+#endif
+
+	double threadCpuSeconds()
+	{
+		struct timespec time;
+		clock_gettime( CLOCK_THREAD_CPUTIME_ID, &time );
+		return time.tv_sec+time.tv_nsec*1e-9;
+	}
+
+	/** @brief Allocates and writes to every page, so that the memory shows up in the RSS as well as the allocator */
+	std::unique_ptr<char[]> touchedAllocation( size_t bytes )
+	{
+		std::unique_ptr<char[]> pMemory( new char[bytes] );
+		std::memset( pMemory.get(), 1, bytes );
+		return pMemory;
+	}
+
+	template<class T>
+	T parameterOrDefault( const edm::ParameterSet& parameterSet, const std::string& name, T defaultValue )
+	{
+		return parameterSet.exists(name) ? parameterSet.getParameter<T>(name) : defaultValue;
+	}
+
+} // end of the unnamed namespace
+
+namespace markstools
+{
+	namespace workloads
+	{
+		class SyntheticCpuBurn : public ::AnalyzerBase
+		{
+		public:
+			SyntheticCpuBurn( const edm::ParameterSet& parameterSet ) : cpuSeconds_( ::parameterOrDefault<double>(parameterSet,"cpuSeconds",0.01) ), sink_(0) {}
+			virtual void analyze( const edm::Event&, const edm::EventSetup& ) override
+			{
+				double endTime=::threadCpuSeconds()+cpuSeconds_;
+				while( ::threadCpuSeconds()<endTime )
+				{
+					for( int index=1; index<1000; ++index ) sink_+=1.0/index;
+				}
+			}
+		private:
+			double cpuSeconds_;
+			volatile double sink_; ///< Stops the loop being optimised away
+		};
+
+		class SyntheticSleep : public ::AnalyzerBase
+		{
+		public:
+			SyntheticSleep( const edm::ParameterSet& parameterSet ) : sleepSeconds_( ::parameterOrDefault<double>(parameterSet,"sleepSeconds",0.01) ) {}
+			virtual void analyze( const edm::Event&, const edm::EventSetup& ) override
+			{
+				std::this_thread::sleep_for( std::chrono::duration<double>(sleepSeconds_) );
+			}
+		private:
+			double sleepSeconds_;
+		};
+
+		class SyntheticAllocationChurn : public ::AnalyzerBase
+		{
+		public:
+			SyntheticAllocationChurn( const edm::ParameterSet& parameterSet )
+				: allocationSize_( ::parameterOrDefault<unsigned int>(parameterSet,"allocationSize",1024) ),
+				  allocationsPerEvent_( ::parameterOrDefault<unsigned int>(parameterSet,"allocationsPerEvent",1000) )
+			{
+				allocations_.reserve( allocationsPerEvent_ ); // So that the vector itself doesn't show up in every event
+			}
+			virtual void analyze( const edm::Event&, const edm::EventSetup& ) override
+			{
+				for( unsigned int index=0; index<allocationsPerEvent_; ++index ) allocations_.push_back( ::touchedAllocation(allocationSize_) );
+				allocations_.clear();
+			}
+		private:
+			size_t allocationSize_;
+			unsigned int allocationsPerEvent_;
+			std::vector<std::unique_ptr<char[]> > allocations_;
+		};
+
+		class SyntheticLeak : public ::AnalyzerBase
+		{
+		public:
+			SyntheticLeak( const edm::ParameterSet& parameterSet )
+				: bytesPerEvent_( ::parameterOrDefault<unsigned int>(parameterSet,"bytesPerEvent",1024*1024) ),
+				  holdForEvents_( ::parameterOrDefault<unsigned int>(parameterSet,"holdForEvents",0) ) {}
+			virtual void analyze( const edm::Event&, const edm::EventSetup& ) override
+			{
+				heldMemory_.push_back( ::touchedAllocation(bytesPerEvent_) );
+				if( holdForEvents_>0 && heldMemory_.size()>holdForEvents_ ) heldMemory_.pop_front();
+			}
+		private:
+			size_t bytesPerEvent_;
+			unsigned int holdForEvents_;
+			std::deque<std::unique_ptr<char[]> > heldMemory_;
+		};
+
+		class SyntheticSpike : public ::AnalyzerBase
+		{
+		public:
+			SyntheticSpike( const edm::ParameterSet& parameterSet )
+				: spikeBytes_( ::parameterOrDefault<unsigned int>(parameterSet,"spikeBytes",256*1024*1024) ),
+				  spikeInterval_( std::max( 1u, ::parameterOrDefault<unsigned int>(parameterSet,"spikeInterval",10) ) ), eventsSeen_(0) {}
+			virtual void analyze( const edm::Event&, const edm::EventSetup& ) override
+			{
+				if( eventsSeen_++ % spikeInterval_ != 0 ) return;
+				std::unique_ptr<char[]> pSpike=::touchedAllocation( spikeBytes_ );
+				sink_=pSpike[spikeBytes_-1]; // Make sure the compiler can't optimise the allocation away
+			}
+		private:
+			size_t spikeBytes_;
+			unsigned int spikeInterval_;
+			unsigned int eventsSeen_;
+			volatile char sink_;
+		};
+
+	} // end of namespace workloads
+} // end of namespace markstools
+
+using markstools::workloads::SyntheticCpuBurn;
+DEFINE_FWK_MODULE( SyntheticCpuBurn );
+
+using markstools::workloads::SyntheticSleep;
+DEFINE_FWK_MODULE( SyntheticSleep );
+
+using markstools::workloads::SyntheticAllocationChurn;
+DEFINE_FWK_MODULE( SyntheticAllocationChurn );
+
+using markstools::workloads::SyntheticLeak;
+DEFINE_FWK_MODULE( SyntheticLeak );
+
+using markstools::workloads::SyntheticSpike;
+DEFINE_FWK_MODULE( SyntheticSpike );
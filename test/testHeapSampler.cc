@@ -0,0 +1,159 @@
+/** @file
+ * @brief Drives HeapSampler's observers with made up allocations and frees, and checks what it reports.
+ *
+ * The sampler is normally fed by a patched intrusiveMemoryAnalyser (see AllocationObserver.h), which doesn't
+ * exist in any release. The observers never look at the memory, so plain numbers are used for the pointers.
+ * Returns non zero if any check fails.
+ *
+ * @author Mark Grimes (mark.grimes@bristol.ac.uk)
+ * @date 19/Oct/2026
+ */
+#include "MarksTools/Benchmarking/interface/HeapSampler.h"
+#include "MarksTools/Benchmarking/interface/AllocationObserver.h"
+
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+
+namespace
+{
+	int failures=0;
+
+	void check( const std::string& description, double expected, double measured, double tolerance )
+	{
+		bool passed=( std::fabs(measured-expected)<=tolerance );
+		if( !passed ) ++failures;
+		std::cout << ( passed ? "PASS " : "FAIL " ) << description << ": expected " << expected << " +/- " << tolerance << ", got " << measured << std::endl;
+	}
+
+	void* fakePointer( uintptr_t index )
+	{
+		return reinterpret_cast<void*>( 0x10000+index*64 );
+	}
+
+	/** @brief Pointers that HeapSampler's filter puts in the same entry, by running the inverse of its hash on multiples of 2^20 */
+	void* collidingPointer( uint64_t index )
+	{
+		uint64_t value=(index+1)<<20;
+		value^=value>>33;
+		value*=0x4f74430c22a54005ULL; // The multiplicative inverse of 0xff51afd7ed558ccd
+		value^=value>>33;
+		return reinterpret_cast<void*>( static_cast<uintptr_t>(value) );
+	}
+
+	struct ModuleSummary
+	{
+		double allocatedBytes;
+		double liveBytes;
+		double samples;
+	};
+
+	/** @brief Parses the " *HEAPSAMPLE* label,type,allocated,live,samples" lines, keyed on label */
+	std::map<std::string,ModuleSummary> parseSummary( const std::string& output )
+	{
+		std::map<std::string,ModuleSummary> summaries;
+		std::istringstream input( output );
+		std::string line;
+		while( std::getline( input, line ) )
+		{
+			if( line.compare( 0, 14, " *HEAPSAMPLE* " )!=0 ) continue;
+			std::istringstream columns( line.substr(14) );
+			std::string label, type, allocated, live, samples;
+			std::getline( columns, label, ',' );
+			std::getline( columns, type, ',' );
+			std::getline( columns, allocated, ',' );
+			std::getline( columns, live, ',' );
+			std::getline( columns, samples, ',' );
+			summaries[label]=ModuleSummary{ std::stod(allocated), std::stod(live), std::stod(samples) };
+		}
+		return summaries;
+	}
+
+	/** @brief Sums the bytes on the folded stack lines for each module, i.e. the text before the first ';' */
+	std::map<std::string,double> foldedTotals( const std::string& output )
+	{
+		std::map<std::string,double> totals;
+		std::istringstream input( output );
+		std::string line;
+		while( std::getline( input, line ) )
+		{
+			size_t lastSpace=line.rfind(' ');
+			if( lastSpace==std::string::npos ) continue;
+			totals[line.substr( 0, line.find_first_of("; ") )]+=std::stod( line.substr(lastSpace+1) );
+		}
+		return totals;
+	}
+
+} // end of the unnamed namespace
+
+int main()
+{
+	using markstools::services::HeapSampler;
+	using markstools::services::IAllocationObserver;
+
+	// Roughly statistical: with this many samples the estimates should be well within a few percent
+	const size_t meanSampleInterval=4096;
+	const size_t allocationSize=1000;
+	const size_t numberOfAllocations=200000;
+	const double totalBytes=double(allocationSize)*numberOfAllocations;
+	const double tolerance=0.05*totalBytes;
+
+	HeapSampler sampler( meanSampleInterval );
+	IAllocationObserver* pProducer=sampler.observerForModule( "producer", "TestProducer" );
+	IAllocationObserver* pAnalyser=sampler.observerForModule( "analyser", "TestAnalyser" );
+
+	// The producer keeps every allocation, the analyser frees all of its own and half of the producer's
+	for( size_t index=0; index<numberOfAllocations; ++index ) pProducer->allocated( ::fakePointer(2*index), allocationSize );
+	for( size_t index=0; index<numberOfAllocations; ++index )
+	{
+		pAnalyser->allocated( ::fakePointer(2*index+1), allocationSize );
+		pAnalyser->deallocated( ::fakePointer(2*index+1) );
+	}
+	for( size_t index=0; index<numberOfAllocations; index+=2 ) pProducer->deallocated( ::fakePointer(2*index) );
+
+	std::ostringstream summaryOutput;
+	sampler.printSummary( summaryOutput );
+	std::map<std::string,::ModuleSummary> summaries=::parseSummary( summaryOutput.str() );
+	check( "producer allocated bytes", totalBytes, summaries["producer"].allocatedBytes, tolerance );
+	check( "producer live bytes", 0.5*totalBytes, summaries["producer"].liveBytes, tolerance );
+	// Each allocation is sampled if it crosses the next sample point
+	const double expectedSamples=numberOfAllocations*( 1-std::exp(-double(allocationSize)/meanSampleInterval) );
+	check( "producer samples", expectedSamples, summaries["producer"].samples, 0.05*expectedSamples );
+	check( "analyser allocated bytes", totalBytes, summaries["analyser"].allocatedBytes, tolerance );
+	check( "analyser live bytes", 0, summaries["analyser"].liveBytes, 0.5 );
+
+	// The folded stacks should add up to the same totals
+	std::ostringstream allocatedOutput, liveOutput;
+	sampler.writeFoldedStacks( allocatedOutput, false );
+	sampler.writeFoldedStacks( liveOutput, true );
+	check( "producer folded allocated bytes", summaries["producer"].allocatedBytes, ::foldedTotals( allocatedOutput.str() )["producer"], 1+summaries["producer"].samples );
+	check( "producer folded live bytes", summaries["producer"].liveBytes, ::foldedTotals( liveOutput.str() )["producer"], 1+summaries["producer"].samples );
+	check( "analyser folded live bytes", 0, ::foldedTotals( liveOutput.str() )["analyser"], 0.5 );
+
+	// With a sample interval of one byte every allocation is sampled. Lots of live samples in the same entry of
+	// the filter of sampled pointers must not wrap its count, otherwise frees would be missed. The pointers are
+	// made to collide by inverting the hash HeapSampler uses, so this needs changing if that ever does. The
+	// count down to the next sample is per thread, so this is done on a new thread to start from scratch.
+	HeapSampler everySampler( 1 );
+	IAllocationObserver* pEvery=everySampler.observerForModule( "every", "TestEvery" );
+	const size_t collidingAllocations=1000;
+	std::thread collidingThread( [pEvery,collidingAllocations]
+		{
+			for( size_t index=0; index<collidingAllocations; ++index ) pEvery->allocated( ::collidingPointer(index), 64 );
+			for( size_t index=0; index<collidingAllocations; ++index ) pEvery->deallocated( ::collidingPointer(index) );
+		} );
+	collidingThread.join();
+	std::ostringstream everyOutput;
+	everySampler.printSummary( everyOutput );
+	std::map<std::string,::ModuleSummary> everySummaries=::parseSummary( everyOutput.str() );
+	check( "colliding allocations sampled", collidingAllocations, everySummaries["every"].samples, 0 );
+	check( "colliding allocations freed", 0, everySummaries["every"].liveBytes, 0.5 );
+
+	std::cout << failures << " checks failed" << std::endl;
+	return failures>0 ? 1 : 0;
+}